@@ -0,0 +1,329 @@
+/* loadgen.cpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+// end to end load test: runs a debugirc::Server on loopback, connects
+// synthetic IRC clients to it and drives producer threads at a fixed rate.
+// every line carries its production time so clients can measure the
+// producer to client latency.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/array.hpp>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/lexical_cast.hpp>
+#include "debugirc/debugirc.hpp"
+
+namespace
+{
+	using boost::asio::ip::tcp;
+
+	struct Options
+	{
+		Options()
+			: clients(100),
+				channels(1),
+				producers(4),
+				rate(10000),
+				seconds(10),
+				message_size(100),
+				server_threads(0),
+				client_threads(2),
+				async(false)
+		{}
+
+		size_t clients;
+		size_t channels;
+		size_t producers;
+		size_t rate; // per producer and second, 0 means as fast as possible
+		size_t seconds;
+		size_t message_size;
+		size_t server_threads;
+		size_t client_threads;
+		bool async;
+	};
+
+	struct Stats
+	{
+		Stats() : joined(0), messages(0), bytes(0), dropped(0) {}
+		boost::atomic<size_t> joined;
+		boost::atomic<boost::uint64_t> messages;
+		boost::atomic<boost::uint64_t> bytes;
+		boost::atomic<boost::uint64_t> dropped;
+	};
+
+	boost::uint64_t NowMicroseconds()
+	{
+		static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+		return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+	}
+
+	std::string ChannelName(size_t index)
+	{
+		return "#bench" + boost::lexical_cast<std::string>(index);
+	}
+
+	class Client
+		: public boost::enable_shared_from_this<Client>
+	{
+	public:
+		Client(boost::asio::io_service & io_service, const std::string & nick, Stats & stats)
+			: socket_(io_service),
+				nick_(nick),
+				stats_(stats),
+				read_length_(0)
+		{}
+
+		void Connect(const tcp::endpoint & endpoint, size_t channels)
+		{
+			socket_.connect(endpoint);
+			socket_.set_option(tcp::no_delay(true));
+			std::string registration = "NICK " + nick_ + "\r\nUSER " + nick_ + " 0 * :" + nick_ + "\r\n";
+			for(size_t i = 0; i < channels; ++i)
+				registration += "JOIN " + ChannelName(i) + "\r\n";
+			boost::asio::write(socket_, boost::asio::buffer(registration));
+			StartRead();
+		}
+
+		void Close()
+		{
+			boost::system::error_code ignored;
+			socket_.close(ignored);
+		}
+
+		const debugirc::Histogram & GetLatency() const { return latency_; }
+
+	private:
+		void StartRead()
+		{
+			socket_.async_read_some(
+				boost::asio::buffer(buffer_.data() + read_length_, buffer_.size() - read_length_),
+				boost::bind(&Client::HandleRead, shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred));
+		}
+
+		void HandleRead(const boost::system::error_code & error, size_t bytes_transferred)
+		{
+			if(error)
+				return;
+			const boost::uint64_t now = NowMicroseconds();
+			char * begin = buffer_.data();
+			char * end = begin + read_length_ + bytes_transferred;
+			char * line = begin;
+			while(char * eol = static_cast<char *>(std::memchr(line, '\n', end - line)))
+			{
+				HandleLine(line, eol - line, now);
+				line = eol + 1;
+			}
+			read_length_ = end - line;
+			if(read_length_ == buffer_.size())
+				read_length_ = 0;
+			else if(line != begin && read_length_)
+				std::memmove(begin, line, read_length_);
+			StartRead();
+		}
+
+		void HandleLine(const char * line, size_t length, boost::uint64_t now)
+		{
+			std::string text(line, length);
+			size_t command = text.find(' ');
+			if(command == std::string::npos)
+				return;
+			if(text.compare(command, 10, " PRIVMSG #") == 0)
+			{
+				size_t body = text.find(" :", command + 1);
+				if(body == std::string::npos)
+					return;
+				boost::uint64_t produced = std::strtoull(text.c_str() + body + 2, 0, 10);
+				if(produced && produced <= now)
+					latency_.Record(now - produced);
+				stats_.messages.fetch_add(1, boost::memory_order_relaxed);
+				stats_.bytes.fetch_add(length + 1, boost::memory_order_relaxed);
+			}
+			else if(text.compare(command, 6, " JOIN ") == 0)
+			{
+				stats_.joined.fetch_add(1, boost::memory_order_relaxed);
+			}
+			else if(text.compare(command, 8, " NOTICE ") == 0)
+			{
+				size_t body = text.find(" :", command + 1);
+				if(body != std::string::npos && text.find("lines dropped", body) != std::string::npos)
+					stats_.dropped.fetch_add(std::strtoull(text.c_str() + body + 2, 0, 10), boost::memory_order_relaxed);
+			}
+		}
+
+		tcp::socket socket_;
+		std::string nick_;
+		Stats & stats_;
+		boost::array<char, 64 * 1024> buffer_;
+		size_t read_length_;
+		debugirc::Histogram latency_;
+	};
+
+	typedef boost::shared_ptr<Client> ClientPtr;
+
+	void ProducerThread(debugirc::Chat & chat, const Options & options, size_t index,
+			boost::atomic<bool> & running, boost::atomic<boost::uint64_t> & sent)
+	{
+		std::vector<std::string> channels;
+		for(size_t i = 0; i < options.channels; ++i)
+			channels.push_back(ChannelName(i));
+		const std::string payload(options.message_size, 'x');
+		std::string line;
+		const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		boost::uint64_t produced = 0;
+		while(running.load(boost::memory_order_relaxed))
+		{
+			if(options.rate)
+			{
+				boost::uint64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+				if(produced >= elapsed * options.rate / 1000000)
+				{
+					boost::this_thread::sleep(boost::posix_time::microseconds(200));
+					continue;
+				}
+			}
+			char stamp[32];
+			int stamp_length = std::sprintf(stamp, "%llu ", static_cast<unsigned long long>(NowMicroseconds()));
+			line.assign(stamp, stamp_length);
+			line += payload;
+			chat.DeliverChannel(channels[(produced + index) % channels.size()], line);
+			++produced;
+		}
+		sent.fetch_add(produced);
+	}
+
+	bool ParseOptions(int argc, char ** argv, Options & options)
+	{
+		for(int i = 1; i < argc; ++i)
+		{
+			std::string arg(argv[i]);
+			size_t pos = arg.find('=');
+			if(pos == std::string::npos)
+				return false;
+			std::string name = arg.substr(0, pos);
+			size_t value = std::strtoul(arg.c_str() + pos + 1, 0, 10);
+			if(name == "clients") options.clients = value;
+			else if(name == "channels") options.channels = value ? value : 1;
+			else if(name == "producers") options.producers = value;
+			else if(name == "rate") options.rate = value;
+			else if(name == "seconds") options.seconds = value;
+			else if(name == "size") options.message_size = value;
+			else if(name == "server_threads") options.server_threads = value;
+			else if(name == "client_threads") options.client_threads = value ? value : 1;
+			else if(name == "async") options.async = value != 0;
+			else return false;
+		}
+		return true;
+	}
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if(!ParseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: debugirc_loadgen [clients=N] [channels=N] [producers=N] [rate=N]"
+			" [seconds=N] [size=N] [server_threads=N] [client_threads=N] [async=0|1]\n";
+		return 1;
+	}
+	try
+	{
+		debugirc::IoServicePool server_pool(options.server_threads);
+		debugirc::Server server(server_pool, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+		for(size_t i = 0; i < options.channels; ++i)
+			server.GetChat().AddChannel(ChannelName(i), "benchmark");
+		if(options.async)
+			server.GetChat().EnableAsyncDelivery(server_pool.GetIoService(0));
+		server_pool.Start();
+
+		boost::asio::io_service client_service;
+		boost::scoped_ptr<boost::asio::io_service::work> client_work(new boost::asio::io_service::work(client_service));
+		boost::thread_group client_threads;
+		for(size_t i = 0; i < options.client_threads; ++i)
+			client_threads.create_thread(boost::bind(&boost::asio::io_service::run, &client_service));
+
+		Stats stats;
+		std::vector<ClientPtr> clients;
+		for(size_t i = 0; i < options.clients; ++i)
+		{
+			ClientPtr client(new Client(client_service, "c" + boost::lexical_cast<std::string>(i), stats));
+			client->Connect(server.GetEndpoint(), options.channels);
+			clients.push_back(client);
+		}
+		const size_t subscriptions = options.clients * options.channels;
+		for(int i = 0; i < 1000 && stats.joined.load() < subscriptions; ++i)
+			boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+		if(stats.joined.load() < subscriptions)
+			std::cerr << "warning: only " << stats.joined.load() << " of " << subscriptions << " joins confirmed\n";
+
+		boost::atomic<bool> running(true);
+		boost::atomic<boost::uint64_t> sent(0);
+		const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		boost::thread_group producers;
+		for(size_t i = 0; i < options.producers; ++i)
+			producers.create_thread(boost::bind(&ProducerThread, boost::ref(server.GetChat()),
+						boost::cref(options), i, boost::ref(running), boost::ref(sent)));
+		boost::this_thread::sleep(boost::posix_time::seconds(options.seconds));
+		running = false;
+		producers.join_all();
+
+		// every line goes to all clients of its channel
+		const boost::uint64_t expected = sent.load() * options.clients;
+		boost::uint64_t received = stats.messages.load();
+		for(int idle = 0; idle < 20 && received + stats.dropped.load() < expected; )
+		{
+			boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+			boost::uint64_t now_received = stats.messages.load();
+			idle = now_received == received ? idle + 1 : 0;
+			received = now_received;
+		}
+		const double elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+
+		for(size_t i = 0; i < clients.size(); ++i)
+			clients[i]->Close();
+		client_work.reset();
+		client_threads.join_all();
+		server_pool.Stop();
+
+		debugirc::Histogram latency;
+		for(size_t i = 0; i < clients.size(); ++i)
+			latency.Merge(clients[i]->GetLatency());
+
+		std::cout << "clients " << options.clients << "\n"
+			<< "channels " << options.channels << "\n"
+			<< "producers " << options.producers << "\n"
+			<< "rate_per_producer " << options.rate << "\n"
+			<< "message_size " << options.message_size << "\n"
+			<< "server_threads " << server_pool.GetSize() << "\n"
+			<< "elapsed_s " << elapsed << "\n"
+			<< "produced " << sent.load() << "\n"
+			<< "expected " << expected << "\n"
+			<< "delivered " << received << "\n"
+			<< "dropped " << stats.dropped.load() << "\n"
+			<< "delivered_msgs_per_s " << static_cast<boost::uint64_t>(received / elapsed) << "\n"
+			<< "delivered_bytes_per_s " << static_cast<boost::uint64_t>(stats.bytes.load() / elapsed) << "\n"
+			<< "latency_us_p50 " << latency.GetPercentile(0.5) << "\n"
+			<< "latency_us_p99 " << latency.GetPercentile(0.99) << "\n"
+			<< "latency_us_p999 " << latency.GetPercentile(0.999) << "\n"
+			<< "latency_us_max " << latency.GetMax() << "\n";
+	}
+	catch(std::exception & e)
+	{
+		std::cerr<<"unhandled std::exception "<<e.what()<<"\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,357 @@
+/* microbench.cpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+// in process benchmarks of the fan out primitives against mock participants.
+// prints one CSV row per configuration so results can be diffed between
+// commits:
+// benchmark,participants,threads,message_size,ops,seconds,ns_per_op,deliveries_per_s
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include "debugirc/debugirc.hpp"
+
+namespace
+{
+	struct Options
+	{
+		Options()
+			: max_threads(boost::thread::hardware_concurrency()),
+				scale(2000000)
+		{
+			if(max_threads < 4)
+				max_threads = 4;
+		}
+
+		std::string filter;
+		size_t max_threads;
+		size_t scale; // participant deliveries per configuration
+	};
+
+	// consumes messages without sharing any state between producer threads
+	class NullParticipant
+		: public debugirc::ChatParticipant
+	{
+	public:
+		NullParticipant() : empty_(0) {}
+		virtual void Deliver(const debugirc::ChatMessage & msg)
+		{
+			if(!msg || msg->empty())
+				++empty_;
+		}
+	private:
+		size_t empty_;
+	};
+
+	typedef boost::function<void (size_t thread, size_t iterations)> Body;
+
+	void RunThread(boost::barrier & start, const Body & body, size_t thread, size_t iterations)
+	{
+		start.wait();
+		body(thread, iterations);
+	}
+
+	double RunThreads(size_t threads, size_t iterations, const Body & body)
+	{
+		boost::barrier start(threads + 1);
+		boost::thread_group group;
+		for(size_t i = 0; i < threads; ++i)
+			group.create_thread(boost::bind(&RunThread, boost::ref(start), boost::cref(body), i, iterations));
+		// taken before releasing the workers, they may finish before this
+		// thread is scheduled again
+		const boost::posix_time::ptime begin = boost::posix_time::microsec_clock::universal_time();
+		start.wait();
+		group.join_all();
+		return (boost::posix_time::microsec_clock::universal_time() - begin).total_microseconds() / 1e6;
+	}
+
+	size_t Iterations(const Options & options, size_t participants, size_t threads)
+	{
+		size_t iterations = options.scale / (participants * threads);
+		return iterations < 100 ? 100 : iterations;
+	}
+
+	void Report(const std::string & name, size_t participants, size_t threads, size_t size,
+			size_t ops, double seconds)
+	{
+		if(seconds <= 0)
+			seconds = 1e-9;
+		std::printf("%s,%lu,%lu,%lu,%lu,%.6f,%.1f,%.0f\n", name.c_str(),
+				static_cast<unsigned long>(participants), static_cast<unsigned long>(threads),
+				static_cast<unsigned long>(size), static_cast<unsigned long>(ops), seconds,
+				seconds * 1e9 / ops, ops * participants / seconds);
+		std::fflush(stdout);
+	}
+
+	std::vector<debugirc::ChatParticipantPtr> MakeParticipants(size_t count)
+	{
+		std::vector<debugirc::ChatParticipantPtr> participants;
+		for(size_t i = 0; i < count; ++i)
+			participants.push_back(debugirc::ChatParticipantPtr(new NullParticipant()));
+		return participants;
+	}
+
+	void ChannelDeliverBody(debugirc::Channel * channel, const debugirc::ChatMessage * msg,
+			size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			channel->Deliver(*msg);
+	}
+
+	void BenchChannelDeliver(const Options & options, size_t participants, size_t threads)
+	{
+		const size_t size = 128;
+		debugirc::Channel channel("#bench", "bench");
+		std::vector<debugirc::ChatParticipantPtr> members = MakeParticipants(participants);
+		for(size_t i = 0; i < members.size(); ++i)
+			channel.Join(members[i]);
+		debugirc::ChatMessage msg(debugirc::Message::Create(std::string(size, 'x')));
+		size_t iterations = Iterations(options, participants, threads);
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChannelDeliverBody, &channel, &msg, _1, _2));
+		Report("channel_deliver", participants, threads, size, iterations * threads, seconds);
+	}
+
+	// every participant has a substring filter that matches one line in two
+	void BenchChannelDeliverFiltered(const Options & options, size_t participants, size_t threads)
+	{
+		const size_t size = 128;
+		debugirc::Channel channel("#bench", "bench");
+		debugirc::FilterSet::Rules rules;
+		rules.push_back(debugirc::FilterRule(debugirc::FilterSubstring, "ERROR"));
+		debugirc::FilterSetPtr filter(new debugirc::FilterSet(rules));
+		std::vector<debugirc::ChatParticipantPtr> members = MakeParticipants(participants);
+		for(size_t i = 0; i < members.size(); ++i)
+		{
+			channel.Join(members[i]);
+			channel.SetFilter(members[i], filter);
+		}
+		std::string text = channel.GetPrefix() + std::string(size, 'x') + "\n";
+		text += channel.GetPrefix() + std::string(size - 5, 'x') + "ERROR\n";
+		debugirc::ChatMessage msg(debugirc::Message::Create(text));
+		size_t iterations = Iterations(options, participants, threads);
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChannelDeliverBody, &channel, &msg, _1, _2));
+		Report("channel_deliver_filtered", participants, threads, text.length(), iterations * threads, seconds);
+	}
+
+	void ChatDeliverChannelBody(debugirc::Chat * chat, const std::string * text, size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			chat->DeliverChannel("#bench", *text);
+	}
+
+	void BenchChatDeliverChannel(const Options & options, size_t participants, size_t threads, size_t size)
+	{
+		debugirc::Chat chat;
+		chat.AddChannel("#bench", "bench");
+		std::vector<debugirc::ChatParticipantPtr> members = MakeParticipants(participants);
+		for(size_t i = 0; i < members.size(); ++i)
+			chat.JoinChannel("#bench", members[i]);
+		const std::string text(size, 'x');
+		size_t iterations = Iterations(options, participants, threads);
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChatDeliverChannelBody, &chat, &text, _1, _2));
+		Report("chat_deliver_channel", participants, threads, size, iterations * threads, seconds);
+	}
+
+	std::string FormatIndex(size_t index)
+	{
+		return "value " + boost::lexical_cast<std::string>(index);
+	}
+
+	void ChatDeliverIdleEagerBody(debugirc::Chat * chat, size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			chat->DeliverChannel("#bench", FormatIndex(i));
+	}
+
+	void ChatDeliverIdleDeferredBody(debugirc::Chat * chat, size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			chat->DeliverChannelDeferred("#bench", boost::bind(&FormatIndex, i));
+	}
+
+	// nobody joined: formatting before the call against formatting on demand
+	void BenchChatDeliverIdle(const Options & options, size_t threads)
+	{
+		debugirc::Chat chat;
+		chat.AddChannel("#bench", "bench");
+		size_t iterations = Iterations(options, 1, threads);
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChatDeliverIdleEagerBody, &chat, _1, _2));
+		Report("chat_deliver_idle_eager", 0, threads, 0, iterations * threads, seconds);
+		seconds = RunThreads(threads, iterations, boost::bind(&ChatDeliverIdleDeferredBody, &chat, _1, _2));
+		Report("chat_deliver_idle_deferred", 0, threads, 0, iterations * threads, seconds);
+	}
+
+	void ChatDeliverTreeBody(debugirc::Chat * chat, const std::string * text, size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			chat->DeliverChannel("#bench.app.db.pool", *text);
+	}
+
+	// participants on #bench.app.*, 1000 sibling channels in the tree
+	void BenchChatDeliverTree(const Options & options, size_t participants, size_t threads)
+	{
+		const size_t size = 128;
+		debugirc::Chat chat;
+		chat.AddChannelTree("#bench", "bench", debugirc::ChannelConfig(), 0);
+		for(size_t i = 0; i < 1000; ++i)
+			chat.GetOrCreateChannel("#bench.app.db.pool" + boost::lexical_cast<std::string>(i));
+		std::vector<debugirc::ChatParticipantPtr> members = MakeParticipants(participants);
+		for(size_t i = 0; i < members.size(); ++i)
+			chat.JoinChannel("#bench.app.*", members[i]);
+		const std::string text(size, 'x');
+		size_t iterations = Iterations(options, participants, threads);
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChatDeliverTreeBody, &chat, &text, _1, _2));
+		Report("chat_deliver_tree", participants, threads, size, iterations * threads, seconds);
+	}
+
+	void ChatDeliverAllBody(debugirc::Chat * chat, const std::string * text, size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			chat->DeliverAll(*text);
+	}
+
+	void BenchChatDeliverAll(const Options & options, size_t participants, size_t threads)
+	{
+		const size_t size = 128;
+		debugirc::Chat chat;
+		std::vector<debugirc::ChatParticipantPtr> members = MakeParticipants(participants);
+		for(size_t i = 0; i < members.size(); ++i)
+			chat.Join(members[i]);
+		const std::string text(size, 'x');
+		size_t iterations = Iterations(options, participants, threads);
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChatDeliverAllBody, &chat, &text, _1, _2));
+		Report("chat_deliver_all", participants, threads, size, iterations * threads, seconds);
+	}
+
+	void ChatJoinChannelBody(debugirc::Chat * chat, const std::vector<debugirc::ChatParticipantPtr> * joiners,
+			size_t thread, size_t iterations)
+	{
+		const debugirc::ChatParticipantPtr & participant = (*joiners)[thread];
+		for(size_t i = 0; i < iterations; ++i)
+		{
+			chat->JoinChannel("#bench", participant);
+			chat->LeaveChannel("#bench", participant);
+		}
+	}
+
+	// one op is a JOIN followed by a PART while participants others stay joined
+	void BenchChatJoinChannel(const Options & options, size_t participants, size_t threads)
+	{
+		debugirc::Chat chat;
+		chat.AddChannel("#bench", "bench");
+		std::vector<debugirc::ChatParticipantPtr> members = MakeParticipants(participants);
+		for(size_t i = 0; i < members.size(); ++i)
+			chat.JoinChannel("#bench", members[i]);
+		std::vector<debugirc::ChatParticipantPtr> joiners = MakeParticipants(threads);
+		size_t iterations = Iterations(options, participants, threads) / 10 + 10;
+		double seconds = RunThreads(threads, iterations, boost::bind(&ChatJoinChannelBody, &chat, &joiners, _1, _2));
+		Report("chat_join_channel", participants, threads, 0, iterations * threads, seconds);
+	}
+
+	void SessionDeliverBody(debugirc::Session * session, const debugirc::ChatMessage * msg,
+			size_t, size_t iterations)
+	{
+		for(size_t i = 0; i < iterations; ++i)
+			session->Deliver(*msg);
+	}
+
+	// the io_service never runs, so this measures queueing only
+	void BenchSessionDeliver(const Options & options, size_t threads, size_t size)
+	{
+		boost::asio::io_service io_service;
+		debugirc::Chat chat;
+		size_t iterations = Iterations(options, 1, threads);
+		if(iterations > 1000000)
+			iterations = 1000000;
+		chat.SetSendQueueLimit(static_cast<size_t>(-1), iterations * threads + 1, debugirc::SendQueueDropNewest);
+		debugirc::SessionPtr session(new debugirc::Session(io_service, chat));
+		debugirc::ChatMessage msg(debugirc::Message::Create(std::string(size, 'x')));
+		double seconds = RunThreads(threads, iterations, boost::bind(&SessionDeliverBody, session.get(), &msg, _1, _2));
+		Report("session_deliver", 1, threads, size, iterations * threads, seconds);
+	}
+
+	bool Enabled(const Options & options, const std::string & name)
+	{
+		return options.filter.empty() || name.find(options.filter) != std::string::npos;
+	}
+
+	bool ParseOptions(int argc, char ** argv, Options & options)
+	{
+		for(int i = 1; i < argc; ++i)
+		{
+			std::string arg(argv[i]);
+			size_t pos = arg.find('=');
+			if(pos == std::string::npos)
+				return false;
+			std::string name = arg.substr(0, pos);
+			std::string value = arg.substr(pos + 1);
+			if(name == "filter") options.filter = value;
+			else if(name == "max_threads") options.max_threads = std::strtoul(value.c_str(), 0, 10);
+			else if(name == "scale") options.scale = std::strtoul(value.c_str(), 0, 10);
+			else return false;
+		}
+		if(options.max_threads == 0)
+			options.max_threads = 1;
+		if(options.scale == 0)
+			options.scale = 1;
+		return true;
+	}
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if(!ParseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: debugirc_microbench [filter=substring] [max_threads=N] [scale=N]\n";
+		return 1;
+	}
+	static const size_t participant_counts[] = { 1, 10, 100, 1000, 10000 };
+	static const size_t message_sizes[] = { 16, 256, 4096 };
+	const size_t participant_steps = sizeof(participant_counts) / sizeof(participant_counts[0]);
+	const size_t size_steps = sizeof(message_sizes) / sizeof(message_sizes[0]);
+	std::vector<size_t> thread_counts;
+	for(size_t threads = 1; threads <= options.max_threads; threads *= 2)
+		thread_counts.push_back(threads);
+
+	std::printf("benchmark,participants,threads,message_size,ops,seconds,ns_per_op,deliveries_per_s\n");
+	for(size_t t = 0; t < thread_counts.size(); ++t)
+	{
+		const size_t threads = thread_counts[t];
+		for(size_t p = 0; p < participant_steps; ++p)
+		{
+			const size_t participants = participant_counts[p];
+			if(Enabled(options, "channel_deliver"))
+				BenchChannelDeliver(options, participants, threads);
+			if(Enabled(options, "channel_deliver_filtered"))
+				BenchChannelDeliverFiltered(options, participants, threads);
+			if(Enabled(options, "chat_deliver_channel"))
+				for(size_t s = 0; s < size_steps; ++s)
+					BenchChatDeliverChannel(options, participants, threads, message_sizes[s]);
+			if(Enabled(options, "chat_deliver_tree"))
+				BenchChatDeliverTree(options, participants, threads);
+			if(Enabled(options, "chat_deliver_all"))
+				BenchChatDeliverAll(options, participants, threads);
+			if(Enabled(options, "chat_join_channel"))
+				BenchChatJoinChannel(options, participants, threads);
+		}
+		if(Enabled(options, "chat_deliver_idle"))
+			BenchChatDeliverIdle(options, threads);
+		if(Enabled(options, "session_deliver"))
+			for(size_t s = 0; s < size_steps; ++s)
+				BenchSessionDeliver(options, threads, message_sizes[s]);
+	}
+	return 0;
+}
@@ -6,3 +6,4 @@
 #pragma once
 
 #include "debugirc/server.hpp"
+#include "debugirc/histogram.hpp"
@@ -0,0 +1,134 @@
+/* backlog.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "types.hpp"
+
+namespace debugirc
+{
+	// ring of the most recent messages of a channel, bounded by line count
+	// and by total bytes. producers only contend when they hit the same
+	// slot, so Push stays cheap under concurrent delivery
+	class Backlog
+		: private boost::noncopyable
+	{
+	public:
+		Backlog(size_t capacity, size_t max_bytes)
+			: capacity_(capacity ? capacity : 1),
+				max_bytes_(max_bytes),
+				slots_(new Slot[capacity ? capacity : 1]),
+				next_(0),
+				oldest_(0),
+				bytes_(0)
+		{}
+
+		void Push(const ChatMessage & msg)
+		{
+			const boost::uint64_t seq = next_.fetch_add(1, boost::memory_order_relaxed);
+			Slot & slot = slots_[seq % capacity_];
+			ChatMessage evicted;
+			{
+				SlotLock lock(slot);
+				// a stalled producer must not overwrite a newer line
+				if(slot.msg_ && slot.seq_ > seq)
+					return;
+				evicted.swap(slot.msg_);
+				slot.msg_ = msg;
+				slot.seq_ = seq;
+			}
+			boost::int64_t delta = msg->length();
+			if(evicted)
+				delta -= evicted->length();
+			bytes_.fetch_add(delta, boost::memory_order_relaxed);
+			Trim(seq);
+		}
+
+		// appends up to max_lines messages created at or after since to out,
+		// oldest first. zero max_lines means the whole ring
+		void Collect(size_t max_lines, const boost::posix_time::ptime & since,
+				std::vector<ChatMessage> & out) const
+		{
+			const boost::uint64_t end = next_.load(boost::memory_order_relaxed);
+			boost::uint64_t begin = end > capacity_ ? end - capacity_ : 0;
+			if(max_lines && end > max_lines && end - max_lines > begin)
+				begin = end - max_lines;
+			const boost::uint64_t oldest = oldest_.load(boost::memory_order_relaxed);
+			if(oldest > begin)
+				begin = oldest;
+			for(boost::uint64_t seq = begin; seq < end; ++seq)
+			{
+				Slot & slot = slots_[seq % capacity_];
+				SlotLock lock(slot);
+				if(slot.msg_ && slot.seq_ == seq &&
+						(since.is_special() || slot.msg_->GetCreated() >= since))
+					out.push_back(slot.msg_);
+			}
+		}
+
+	private:
+		struct Slot
+		{
+			Slot() : busy_(false), seq_(0) {}
+			boost::atomic<bool> busy_;
+			boost::uint64_t seq_;
+			ChatMessage msg_;
+		};
+
+		class SlotLock
+			: private boost::noncopyable
+		{
+		public:
+			explicit SlotLock(Slot & slot)
+				: slot_(slot)
+			{
+				while(slot_.busy_.exchange(true, boost::memory_order_acquire))
+				{}
+			}
+			~SlotLock()
+			{
+				slot_.busy_.store(false, boost::memory_order_release);
+			}
+		private:
+			Slot & slot_;
+		};
+
+		// drops the oldest lines until the ring fits into max_bytes_
+		void Trim(boost::uint64_t newest)
+		{
+			while(bytes_.load(boost::memory_order_relaxed) > static_cast<boost::int64_t>(max_bytes_))
+			{
+				boost::uint64_t victim = oldest_.load(boost::memory_order_relaxed);
+				if(victim >= newest)
+					return;
+				if(!oldest_.compare_exchange_weak(victim, victim + 1, boost::memory_order_relaxed))
+					continue;
+				Slot & slot = slots_[victim % capacity_];
+				ChatMessage dropped;
+				{
+					SlotLock lock(slot);
+					if(slot.msg_ && slot.seq_ == victim)
+						dropped.swap(slot.msg_);
+				}
+				if(dropped)
+					bytes_.fetch_sub(dropped->length(), boost::memory_order_relaxed);
+			}
+		}
+
+		const size_t capacity_;
+		const size_t max_bytes_;
+		boost::scoped_array<Slot> slots_;
+		boost::atomic<boost::uint64_t> next_;
+		boost::atomic<boost::uint64_t> oldest_;
+		// signed, evictions may be accounted before the matching insert
+		boost::atomic<boost::int64_t> bytes_;
+	};
+} // namespace debugirc
@@ -6,57 +6,316 @@
 #pragma once
 
 #include <string>
-#include <set>
+#include <vector>
+#include <sstream>
+#include <algorithm>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
-#include <boost/thread/shared_mutex.hpp>
-#include <boost/thread/locks.hpp>
+#include <boost/scoped_ptr.hpp>
 #include "types.hpp"
 #include "participant.hpp"
+#include "subscription.hpp"
+#include "backlog.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "record.hpp"
+#include "ratelimit.hpp"
+#include "journal.hpp"
 
 namespace debugirc
 {
+	struct ChannelConfig
+	{
+		ChannelConfig()
+			: backlog_lines(0),
+				backlog_bytes(1024 * 1024),
+				replay_lines(0),
+				replay_seconds(0),
+				rate_limit(0),
+				rate_burst(0),
+				summary_interval_ms(1000),
+				journal_segment_bytes(64 * 1024 * 1024),
+				journal_segment_seconds(0),
+				journal_segments(16)
+		{}
+
+		// recent lines kept for replay on JOIN, 0 disables the backlog
+		size_t backlog_lines;
+		size_t backlog_bytes;
+		// what a JOIN replays, 0 means no limit
+		size_t replay_lines;
+		size_t replay_seconds;
+		// lines per second above which lines are dropped, 0 means no limit.
+		// burst defaults to one second worth of lines. the number of dropped
+		// lines is announced in the channel with the first line offered after
+		// summary_interval_ms has passed
+		size_t rate_limit;
+		size_t rate_burst;
+		size_t summary_interval_ms;
+		// every line is appended to segment files in journal_directory, empty
+		// disables the journal. a segment is closed when full or after
+		// journal_segment_seconds, only the newest journal_segments are kept.
+		// 0 for either means no limit
+		std::string journal_directory;
+		size_t journal_segment_bytes;
+		size_t journal_segment_seconds;
+		size_t journal_segments;
+	};
+
 	class Channel
 	{
 	public:
 		Channel(const std::string & name, const std::string & title)
 			: name_(name),
-				title_(title)
-		{}
+				title_(title),
+				suppressed_pending_(0),
+				summary_at_(TraceNow())
+		{
+			SetServerName("debugirc");
+		}
+
+		Channel(const std::string & name, const std::string & title, const ChannelConfig & config)
+			: name_(name),
+				title_(title),
+				config_(config),
+				suppressed_pending_(0),
+				summary_at_(TraceNow())
+		{
+			SetServerName("debugirc");
+			if(config_.backlog_lines)
+				backlog_.reset(new Backlog(config_.backlog_lines, config_.backlog_bytes));
+			if(config_.rate_limit)
+				limiter_.reset(new RateLimiter(config_.rate_limit,
+							config_.rate_burst ? config_.rate_burst : config_.rate_limit));
+			if(!config_.journal_directory.empty())
+				journal_.reset(new Journal(config_.journal_directory, name_, config_.journal_segment_bytes,
+							config_.journal_segment_seconds, config_.journal_segments));
+		}
 
 		const std::string & GetTitle() const { return title_; }
 		const std::string & GetName() const { return name_; }
+		const ChannelConfig & GetConfig() const { return config_; }
+
+		// prefix of every PRIVMSG rendered by DeliverLine, cached so the hot
+		// path only copies bytes
+		void SetServerName(const std::string & server_name)
+		{
+			prefix_ = ":" + server_name + " PRIVMSG " + name_ + " :";
+		}
+
+		const std::string & GetPrefix() const { return prefix_; }
 
 		bool Join(const ChatParticipantPtr & participant)
 		{
-			boost::unique_lock<boost::shared_mutex> lock(sync_);
-			return participants_.insert(participant).second;
+			return subscriptions_.Insert(participant);
 		}
 
 		void Leave(const ChatParticipantPtr & participant)
 		{
-			boost::unique_lock<boost::shared_mutex> lock(sync_);
-			participants_.erase(participant);
+			subscriptions_.Erase(participant);
+		}
+
+		// lines are matched before they reach the participant's send queue,
+		// an empty filter removes it
+		bool SetFilter(const ChatParticipantPtr & participant, const FilterSetPtr & filter)
+		{
+			return subscriptions_.SetFilter(participant, filter);
 		}
 
 		void Deliver(const ChatMessage & msg)
 		{
-			boost::shared_lock<boost::shared_mutex> lock(sync_);
-			std::for_each(participants_.begin(), participants_.end(),
-					boost::bind(&ChatParticipant::Deliver, _1, boost::ref(msg)));
+			if(limiter_ && !Admit(std::max<size_t>(1, std::count(msg->data(), msg->data() + msg->length(), '\n'))))
+				return;
+			DeliverNow(msg);
+		}
+
+		// wildcard subscriptions of the channel tree nodes from the root down
+		// to this channel, see ChannelTree. set before the channel is shared
+		void SetRoute(const std::vector<SubscriptionSetPtr> & route) { route_ = route; }
+
+		size_t GetSubscriberCount() const { return subscriptions_.GetSize(); }
+		// lock free, for producers that want to skip work nobody would see.
+		// wildcard subscribers count as subscribers
+		bool HasSubscribers() const
+		{
+			if(subscriptions_.GetSize())
+				return true;
+			for(std::vector<SubscriptionSetPtr>::const_iterator it = route_.begin(); it != route_.end(); ++it)
+				if((*it)->GetSize())
+					return true;
+			return false;
+		}
+		// a line delivered now would be seen by a subscriber, the backlog or
+		// the journal
+		bool HasConsumers() const { return backlog_ || journal_ || HasSubscribers(); }
+		boost::uint64_t GetUnrenderedCount() const { return unrendered_.Get(); }
+		boost::uint64_t GetSuppressedCount() const { return suppressed_.Get(); }
+		boost::uint64_t GetLineCount() const { return lines_.Get(); }
+		boost::uint64_t GetByteCount() const { return bytes_.Get(); }
+		boost::uint64_t GetDeliveryCount() const { return deliveries_.Get(); }
+		const LatencyStats & GetLatency() const { return latency_; }
+		// empty unless journal_directory is configured
+		const JournalPtr & GetJournal() const { return journal_; }
+
+		// recent lines within the configured replay limits, oldest first
+		void GetBacklog(std::vector<ChatMessage> & out) const
+		{
+			if(!backlog_)
+				return;
+			boost::posix_time::ptime since(boost::posix_time::not_a_date_time);
+			if(config_.replay_seconds)
+				since = boost::posix_time::microsec_clock::universal_time() -
+					boost::posix_time::seconds(config_.replay_seconds);
+			backlog_->Collect(config_.replay_lines, since, out);
 		}
 
 		void Deliver(const std::string & msg)
 		{
-			ChatMessage info(new std::string(msg));
-			Deliver(info);
+			Deliver(Message::Create(msg));
+		}
+
+		// delivers text as a PRIVMSG from the server to this channel.
+		// produced is the TraceNow() stamp of a sampled line or 0
+		void DeliverLine(const std::string & text, boost::uint64_t produced = 0)
+		{
+			if(!HasConsumers())
+			{
+				unrendered_.Add();
+				return;
+			}
+			if(limiter_ && !Admit(1))
+				return;
+			ChatMessage msg(Message::Create(prefix_, text, "\n"));
+			msg->SetProduced(produced);
+			DeliverNow(msg);
+		}
+
+		// format() returns the text of a line, it is only called if someone
+		// would see the line and the rate limit lets it through
+		template<typename Format>
+		void DeliverFormatted(const Format & format, boost::uint64_t produced = 0)
+		{
+			if(!HasConsumers())
+			{
+				unrendered_.Add();
+				return;
+			}
+			if(limiter_ && !Admit(1))
+				return;
+			ChatMessage msg(Message::Create(prefix_, format(), "\n"));
+			msg->SetProduced(produced);
+			DeliverNow(msg);
+		}
+
+		// renders the record straight into a single message, nothing is
+		// rendered if nobody would see it
+		void DeliverRecord(const LogRecord & record, boost::uint64_t produced = 0)
+		{
+			if(!HasConsumers())
+			{
+				unrendered_.Add();
+				return;
+			}
+			if(limiter_ && !Admit(1 + std::count(record.message.begin(), record.message.end(), '\n')))
+				return;
+			RenderLength length;
+			RenderRecord(record, prefix_, length);
+			char * text = 0;
+			ChatMessage msg(Message::Create(length.length, text));
+			RenderBuffer buffer(text);
+			RenderRecord(record, prefix_, buffer);
+			msg->SetProduced(produced);
+			DeliverNow(msg);
 		}
 
 	private:
-		std::set<ChatParticipantPtr> participants_;
+		// fan out without rate limiting
+		void DeliverNow(const ChatMessage & msg)
+		{
+			boost::uint64_t dispatched = 0;
+			if(msg->IsTraced())
+			{
+				dispatched = TraceNow();
+				msg->SetDispatched(dispatched);
+				latency_.Record(TraceDispatch, dispatched - msg->GetProduced());
+			}
+			if(backlog_)
+				backlog_->Push(msg);
+			if(journal_)
+				journal_->Append(msg);
+			size_t deliveries = DeliverTo(subscriptions_, msg);
+			// a session subscribed to several matching wildcards gets the line
+			// once per subscription
+			for(std::vector<SubscriptionSetPtr>::const_iterator it = route_.begin(); it != route_.end(); ++it)
+				deliveries += DeliverTo(**it, msg);
+			if(dispatched)
+				latency_.Record(TraceFanout, TraceNow() - dispatched);
+			lines_.Add();
+			bytes_.Add(msg->length());
+			deliveries_.Add(deliveries);
+		}
+
+		size_t DeliverTo(const SubscriptionSet & subscriptions, const ChatMessage & msg)
+		{
+			SubscriptionSet::Snapshot snapshot = subscriptions.Get();
+			for(SubscriptionSet::List::const_iterator it = snapshot->begin(); it != snapshot->end(); ++it)
+			{
+				if(!it->filter)
+					it->participant->Deliver(msg);
+				else if(ChatMessage filtered = it->filter->Apply(msg, prefix_))
+					it->participant->Deliver(filtered);
+			}
+			return snapshot->size();
+		}
+
+		// takes tokens for the given number of lines, counts them as
+		// suppressed if there are not enough and announces suppressed lines
+		// once per summary interval
+		bool Admit(size_t lines)
+		{
+			const boost::uint64_t now = TraceNow();
+			const bool admitted = limiter_->Admit(now, lines);
+			if(!admitted)
+			{
+				suppressed_pending_.fetch_add(lines, boost::memory_order_relaxed);
+				suppressed_.Add(lines);
+			}
+			if(suppressed_pending_.load(boost::memory_order_relaxed))
+				Summarize(now);
+			return admitted;
+		}
+
+		void Summarize(boost::uint64_t now)
+		{
+			boost::uint64_t last = summary_at_.load(boost::memory_order_relaxed);
+			if(now - last < config_.summary_interval_ms * 1000000ull ||
+					!summary_at_.compare_exchange_strong(last, now, boost::memory_order_relaxed))
+				return;
+			const boost::uint64_t count = suppressed_pending_.exchange(0, boost::memory_order_relaxed);
+			if(!count)
+				return;
+			std::ostringstream text;
+			text<<count<<" lines suppressed in last "<<(now - last) / 1000000<<" ms";
+			DeliverNow(Message::Create(prefix_, text.str(), "\n"));
+		}
+
+		SubscriptionSet subscriptions_;
 		std::string name_;
 		std::string title_;
-		boost::shared_mutex sync_;
+		std::string prefix_;
+		ChannelConfig config_;
+		std::vector<SubscriptionSetPtr> route_;
+		boost::scoped_ptr<Backlog> backlog_;
+		JournalPtr journal_;
+		Counter lines_;
+		Counter bytes_;
+		Counter deliveries_;
+		Counter unrendered_;
+		Counter suppressed_;
+		boost::scoped_ptr<RateLimiter> limiter_;
+		boost::atomic<boost::uint64_t> suppressed_pending_;
+		boost::atomic<boost::uint64_t> summary_at_; // TraceNow() of the last summary
+		LatencyStats latency_;
 	};
 
 	typedef boost::shared_ptr<Channel> ChannelPtr;
@@ -0,0 +1,124 @@
+/* channeltree.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/noncopyable.hpp>
+#include "subscription.hpp"
+#include "channel.hpp"
+
+namespace debugirc
+{
+	// prefix trie over the dotted names below a root channel, e.g. #log.app.db
+	// below #log. every node holds the subscriptions of the wildcard naming
+	// its subtree (#log.app.* for the node of #log.app). a channel is handed
+	// the sets on its path when it is created, so a line reaches wildcard
+	// subscribers in time proportional to the depth of its channel.
+	// not synchronized, Chat guards it with its channel lock
+	class ChannelTree
+		: private boost::noncopyable
+	{
+	public:
+		static const size_t MaxDepth = 32;
+
+		// max_nodes bounds the channels and wildcards clients can create
+		ChannelTree(const std::string & root, const std::string & title, const ChannelConfig & config,
+				size_t max_nodes)
+			: root_(root),
+				title_(title),
+				config_(config),
+				max_nodes_(max_nodes),
+				nodes_(1),
+				root_node_(new Node())
+		{}
+
+		const std::string & GetRoot() const { return root_; }
+		const std::string & GetTitle() const { return title_; }
+		const ChannelConfig & GetConfig() const { return config_; }
+
+		// name is the root or a name below it
+		bool Contains(const std::string & name) const
+		{
+			return name.compare(0, root_.length(), root_) == 0 &&
+				(name.length() == root_.length() || name[root_.length()] == '.');
+		}
+
+		static bool IsWildcard(const std::string & name)
+		{
+			return name.length() > 2 && name.compare(name.length() - 2, 2, ".*") == 0;
+		}
+
+		// the wildcard sets from the root down to the node of name, creating
+		// missing nodes. false if name has an empty or wildcard segment, is
+		// deeper than MaxDepth or the tree is full
+		bool GetRoute(const std::string & name, std::vector<SubscriptionSetPtr> & route)
+		{
+			return Walk(name, true, &route) != 0;
+		}
+
+		// the set of a wildcard name like #log.app.*, empty if it is not
+		// valid or does not exist and create is false
+		SubscriptionSetPtr GetWildcard(const std::string & name, bool create)
+		{
+			if(!IsWildcard(name))
+				return SubscriptionSetPtr();
+			Node * node = Walk(name.substr(0, name.length() - 2), create, 0);
+			return node ? node->wildcard : SubscriptionSetPtr();
+		}
+
+	private:
+		struct Node
+		{
+			Node() : wildcard(new SubscriptionSet()) {}
+			SubscriptionSetPtr wildcard;
+			boost::unordered_map<std::string, boost::shared_ptr<Node> > children;
+		};
+
+		Node * Walk(const std::string & name, bool create, std::vector<SubscriptionSetPtr> * route)
+		{
+			if(!Contains(name))
+				return 0;
+			Node * node = root_node_.get();
+			if(route)
+				route->push_back(node->wildcard);
+			size_t depth = 0;
+			for(size_t begin = root_.length() + 1; begin <= name.length(); ++depth)
+			{
+				size_t end = name.find('.', begin);
+				if(end == std::string::npos)
+					end = name.length();
+				if(end == begin || depth >= MaxDepth || name.find('*', begin) < end)
+					return 0;
+				const std::string segment(name, begin, end - begin);
+				boost::unordered_map<std::string, boost::shared_ptr<Node> >::iterator it = node->children.find(segment);
+				if(it == node->children.end())
+				{
+					if(!create || (max_nodes_ && nodes_ >= max_nodes_))
+						return 0;
+					it = node->children.insert(std::make_pair(segment, boost::shared_ptr<Node>(new Node()))).first;
+					++nodes_;
+				}
+				node = it->second.get();
+				if(route)
+					route->push_back(node->wildcard);
+				begin = end + 1;
+			}
+			return node;
+		}
+
+		const std::string root_;
+		const std::string title_;
+		const ChannelConfig config_;
+		const size_t max_nodes_;
+		size_t nodes_;
+		boost::shared_ptr<Node> root_node_;
+	};
+
+	typedef boost::shared_ptr<ChannelTree> ChannelTreePtr;
+} // namespace debugirc
@@ -5,17 +5,24 @@
 
 #pragma once
 
-#include <set>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/atomic.hpp>
+#include <boost/asio/io_service.hpp>
 #include "types.hpp"
+#include "mpscqueue.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include "participant.hpp"
 #include "channel.hpp"
+#include "channeltree.hpp"
+#include "producer.hpp"
 #include "authmanager.hpp"
 #include "messagehandler.hpp"
+#include "handlerpool.hpp"
 
 namespace debugirc
 {
@@ -30,16 +37,43 @@ namespace debugirc
 			virtual void Visit(const ChannelMap::value_type &) = 0;
 		};
 
+		static const size_t DefaultWriteBatchLimit = 64 * 1024;
+		static const size_t DefaultSendQueueBytes = 8 * 1024 * 1024;
+		static const size_t DefaultSendQueueMessages = 64 * 1024;
+		static const size_t DefaultControlQueueBytes = 64 * 1024;
+		static const size_t IngestBatch = 256;
+		static const size_t DefaultTreeNodes = 10000;
+
 		Chat()
 		  : server_name_("debugirc"),
 			  motd_start_("DebugIRC"),
 				motd_("This is debug irc interface for logging and similar tasks"),
-				auth_manager_(new AuthManager())
+				write_batch_limit_(DefaultWriteBatchLimit),
+				send_queue_bytes_(DefaultSendQueueBytes),
+				send_queue_messages_(DefaultSendQueueMessages),
+				send_queue_policy_(SendQueueDropNewest),
+				control_queue_bytes_(DefaultControlQueueBytes),
+				auth_manager_(new AuthManager()),
+				handler_pool_(0),
+				ingest_service_(0),
+				ingest_scheduled_(false)
+		{
+		}
+
+		~Chat()
 		{
+			while(IngestRecord * record = ingest_queue_.Pop())
+				delete record;
 		}
 
 		const std::string & GetServerName() const { return server_name_; }
-		void SetServerName(const std::string & value) { server_name_ = value; }
+		void SetServerName(const std::string & value)
+		{
+			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
+			server_name_ = value;
+			for(ChannelMap::iterator it = channels_.begin(); it != channels_.end(); ++it)
+				it->second->SetServerName(server_name_);
+		}
 
 		const std::string & GetMOTDStart() const { return motd_start_; }
 		void SetMOTDStart(const std::string & value) { motd_start_ = value; }
@@ -50,10 +84,112 @@ namespace debugirc
 		const std::string & GetAutoJoin() const { return auto_join_; }
 		void SetAutoJoin(const std::string & value) { auto_join_ = value; }
 
+		// upper bound for bytes a session gathers into a single socket write
+		size_t GetWriteBatchLimit() const { return write_batch_limit_; }
+		void SetWriteBatchLimit(size_t value) { write_batch_limit_ = value; }
+
+		// per session budget for messages waiting to be written
+		size_t GetSendQueueBytes() const { return send_queue_bytes_; }
+		size_t GetSendQueueMessages() const { return send_queue_messages_; }
+		SendQueuePolicy GetSendQueuePolicy() const { return send_queue_policy_; }
+		void SetSendQueueLimit(size_t max_bytes, size_t max_messages, SendQueuePolicy policy)
+		{
+			send_queue_bytes_ = max_bytes;
+			send_queue_messages_ = max_messages;
+			send_queue_policy_ = policy;
+		}
+
+		// per session budget for replies, PING, JOIN acknowledgements and
+		// other control traffic. it is written ahead of channel lines and
+		// does not count against the send queue. a reply is always queued
+		// when no other one is waiting, further ones are dropped over budget
+		size_t GetControlQueueBytes() const { return control_queue_bytes_; }
+		void SetControlQueueLimit(size_t max_bytes) { control_queue_bytes_ = max_bytes; }
+
 		void AddChannel(const std::string & name, const std::string & title)
 		{
+			ChannelPtr channel(new Channel(name, title));
+			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
+			InsertChannel(channel);
+		}
+
+		void AddChannel(const std::string & name, const std::string & title, const ChannelConfig & config)
+		{
+			ChannelPtr channel(new Channel(name, title, config));
 			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
-			channels_.insert(std::make_pair(name, ChannelPtr(new Channel(name, title))));
+			InsertChannel(channel);
+		}
+
+		// adds root as a channel and makes every dotted name below it, like
+		// #log.app.db.pool under #log, a channel created on first use with
+		// the given title and config. JOIN #log.app.* subscribes to #log.app
+		// and everything below it. max_nodes bounds the names and wildcards
+		// the tree keeps, 0 means no limit. must be called before channels
+		// below root are added, trees must not nest
+		void AddChannelTree(const std::string & root, const std::string & title, const ChannelConfig & config,
+				size_t max_nodes = DefaultTreeNodes)
+		{
+			ChannelPtr channel(new Channel(root, title, config));
+			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
+			trees_.push_back(ChannelTreePtr(new ChannelTree(root, title, config, max_nodes)));
+			InsertChannel(channel);
+		}
+
+		ChannelPtr GetChannel(const std::string & name) const
+		{
+			boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
+			ChannelMap::const_iterator it = channels_.find(name);
+			return it != channels_.end() ? it->second : ChannelPtr();
+		}
+
+		// like GetChannel, but a name below a channel tree is created if
+		// it does not exist yet
+		ChannelPtr GetOrCreateChannel(const std::string & name)
+		{
+			{
+				boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
+				ChannelMap::const_iterator it = channels_.find(name);
+				if(it != channels_.end())
+					return it->second;
+				if(!FindTree(name))
+					return ChannelPtr();
+			}
+			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
+			ChannelMap::const_iterator it = channels_.find(name);
+			if(it != channels_.end())
+				return it->second;
+			ChannelTree * tree = FindTree(name);
+			std::vector<SubscriptionSetPtr> route;
+			if(!tree || !tree->GetRoute(name, route))
+				return ChannelPtr();
+			ChannelPtr channel(new Channel(name, tree->GetTitle(), tree->GetConfig()));
+			channel->SetServerName(server_name_);
+			channel->SetRoute(route);
+			channels_.insert(std::make_pair(name, channel));
+			return channel;
+		}
+
+		// true if someone is joined to the channel or to a wildcard matching
+		// it. hot paths should keep the ChannelPtr from GetOrCreateChannel
+		// and ask Channel::HasSubscribers, which needs no channel map lock
+		bool HasSubscribers(const std::string & name)
+		{
+			ChannelPtr channel = GetOrCreateChannel(name);
+			return channel && channel->HasSubscribers();
+		}
+
+		// returns the existing channel or adds a new one
+		ChannelPtr FindOrAddChannel(const std::string & name, const std::string & title, const ChannelConfig & config)
+		{
+			if(ChannelPtr channel = GetChannel(name))
+				return channel;
+			ChannelPtr channel(new Channel(name, title, config));
+			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
+			ChannelMap::const_iterator it = channels_.find(name);
+			if(it != channels_.end())
+				return it->second;
+			InsertChannel(channel);
+			return channel;
 		}
 
 		void RemoveChannel(const std::string & name)
@@ -73,27 +209,68 @@ namespace debugirc
 
 		void Join(const ChatParticipantPtr & participant)
 		{
-			boost::unique_lock<boost::shared_mutex> lock(participant_sync_);
-			participants_.insert(participant);
+			participants_.Insert(participant);
 		}
 
 		void Leave(const ChatParticipantPtr & participant)
 		{
-			boost::unique_lock<boost::shared_mutex> lock(participant_sync_);
-			participants_.erase(participant);
+			participants_.Erase(participant);
 		}
 
+		// name may be a channel tree wildcard like #log.app.*
 		bool JoinChannel(const std::string & name, const ChatParticipantPtr & participant)
+		{
+			if(ChannelTree::IsWildcard(name))
+			{
+				SubscriptionSetPtr wildcard = GetWildcard(name, true);
+				return wildcard && wildcard->Insert(participant);
+			}
+			ChannelPtr channel = GetOrCreateChannel(name);
+			return channel && channel->Join(participant);
+		}
+
+		// buffered writer for a channel, see Producer. returns an empty
+		// pointer if there is no such channel. the delay timer runs on the
+		// async delivery io_service if one is enabled
+		ProducerPtr OpenProducer(const std::string & name, size_t max_lines = 64,
+				const boost::posix_time::time_duration & max_delay = boost::posix_time::milliseconds(100))
+		{
+			ChannelPtr channel = GetOrCreateChannel(name);
+			if(!channel)
+				return ProducerPtr();
+			return ProducerPtr(new Producer(channel, max_lines, max_delay, ingest_service_));
+		}
+
+		void GetChannelBacklog(const std::string & name, std::vector<ChatMessage> & out) const
 		{
+			boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
+			ChannelMap::const_iterator it = channels_.find(name);
+			if(it != channels_.end())
+				it->second->GetBacklog(out);
+		}
+
+		bool SetChannelFilter(const std::string & name, const ChatParticipantPtr & participant, const FilterSetPtr & filter)
+		{
+			if(ChannelTree::IsWildcard(name))
+			{
+				SubscriptionSetPtr wildcard = GetWildcard(name, false);
+				return wildcard && wildcard->SetFilter(participant, filter);
+			}
 			boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
 			ChannelMap::iterator it = channels_.find(name);
 			if(it == channels_.end())
 				return false;
-			return it->second->Join(participant);
+			return it->second->SetFilter(participant, filter);
 		}
 
 		void LeaveChannel(const std::string & name, const ChatParticipantPtr & participant)
 		{
+			if(ChannelTree::IsWildcard(name))
+			{
+				if(SubscriptionSetPtr wildcard = GetWildcard(name, false))
+					wildcard->Erase(participant);
+				return;
+			}
 			boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
 			ChannelMap::iterator it = channels_.find(name);
 			if(it == channels_.end())
@@ -103,22 +280,70 @@ namespace debugirc
 
 		void DeliverAll(const std::string & msg)
 		{
-			boost::shared_lock<boost::shared_mutex> lock(participant_sync_);
-			ChatMessage info(new std::string(msg));
-			std::for_each(participants_.begin(), participants_.end(),
-					boost::bind(&ChatParticipant::Deliver, _1, boost::ref(info)));
+			ChatMessage info(Message::Create(msg));
+			participants_.ForEach(boost::bind(&ChatParticipant::Deliver, _1, boost::ref(info)));
+		}
+
+		// switches DeliverChannel to non blocking mode: producers only push
+		// the raw line to a lock free queue, formatting and fan out happen on
+		// the given io_service. must be called before producers are started
+		void EnableAsyncDelivery(boost::asio::io_service & io_service)
+		{
+			ingest_service_ = &io_service;
 		}
 
+		// traces one of every one_in lines passed to DeliverChannel through
+		// fan out, send queue and socket write. 0 (the default) turns it off
+		void SetTraceSampleRate(size_t one_in) { trace_sampler_.SetRate(one_in); }
+		size_t GetTraceSampleRate() const { return trace_sampler_.GetRate(); }
+
 		void DeliverChannel(const std::string & name, const std::string & msg)
 		{
-			boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
-			ChannelMap::iterator it = channels_.find(name);
-			if(it != channels_.end())
+			const boost::uint64_t produced = trace_sampler_.Sample() ? TraceNow() : 0;
+			if(ingest_service_)
+			{
+				PushIngest(new IngestRecord(name, msg, produced));
+				return;
+			}
+			DeliverChannelNow(name, msg, produced);
+		}
+
+		// delivers to record.channel, the record is rendered only if the
+		// channel has subscribers or a backlog
+		void DeliverChannel(const LogRecord & record)
+		{
+			const boost::uint64_t produced = trace_sampler_.Sample() ? TraceNow() : 0;
+			if(ingest_service_)
+			{
+				PushIngest(new IngestRecord(record, produced));
+				return;
+			}
+			DeliverRecordNow(record, produced);
+		}
+
+		// format() returns the line and runs only if the channel has
+		// subscribers, a backlog or a journal, so nothing is formatted for a
+		// channel nobody watches. with async delivery it runs on the calling
+		// thread before the line is queued, so it may capture references
+		template<typename Format>
+		void DeliverChannelDeferred(const ChannelPtr & channel, const Format & format)
+		{
+			if(!channel)
+				return;
+			const boost::uint64_t produced = trace_sampler_.Sample() ? TraceNow() : 0;
+			if(ingest_service_)
 			{
-				std::stringstream strstr;
-				strstr<<":"<<GetServerName()<<" PRIVMSG "<<name<<" :"<<msg<<"\n";
-				it->second->Deliver(strstr.str());
+				if(channel->HasConsumers())
+					PushIngest(new IngestRecord(channel->GetName(), format(), produced));
+				return;
 			}
+			channel->DeliverFormatted(format, produced);
+		}
+
+		template<typename Format>
+		void DeliverChannelDeferred(const std::string & name, const Format & format)
+		{
+			DeliverChannelDeferred(GetOrCreateChannel(name), format);
 		}
 
 		bool Authorize(const std::string & username, const std::string & password)
@@ -130,19 +355,200 @@ namespace debugirc
 		const MessageHandlerPtr & GetMessageHandler() { return message_handler_; }
 		void SetMessageHandler(const MessageHandlerPtr & value) { message_handler_ = value; }
 
+		// runs the message handler on the pool instead of the session's io
+		// thread, the handler has to be thread safe. must be called before
+		// the server is started
+		void EnableHandlerPool(HandlerPool & pool) { handler_pool_ = &pool; }
+		HandlerPool * GetHandlerPool() const { return handler_pool_; }
+
+		ChatMetrics & GetMetrics() { return metrics_; }
+
+		// plain text metrics in the prometheus exposition format, one
+		// sample per line. used by STATS and the scrape listener
+		void WriteMetrics(std::ostream & ostr) const
+		{
+			ostr<<"debugirc_sessions_accepted_total "<<metrics_.sessions_accepted.Get()<<"\n"
+				<<"debugirc_sessions_active "<<metrics_.sessions_active.Get()<<"\n"
+				<<"debugirc_queued_messages "<<metrics_.queued_messages.Get()<<"\n"
+				<<"debugirc_queued_bytes "<<metrics_.queued_bytes.Get()<<"\n"
+				<<"debugirc_sent_messages_total "<<metrics_.sent_messages.Get()<<"\n"
+				<<"debugirc_sent_bytes_total "<<metrics_.sent_bytes.Get()<<"\n"
+				<<"debugirc_dropped_messages_total "<<metrics_.dropped_messages.Get()<<"\n";
+			if(handler_pool_)
+				ostr<<"debugirc_handler_pending "<<handler_pool_->GetPendingCount()<<"\n"
+					<<"debugirc_handler_commands_total "<<handler_pool_->GetHandledCount()<<"\n"
+					<<"debugirc_handler_rejected_total "<<handler_pool_->GetRejectedCount()<<"\n";
+			{
+				boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
+				for(ChannelMap::const_iterator it = channels_.begin(); it != channels_.end(); ++it)
+				{
+					const Channel & channel = *it->second;
+					const std::string label = "{channel=\"" + EscapeLabel(it->first) + "\"} ";
+					ostr<<"debugirc_channel_subscribers"<<label<<channel.GetSubscriberCount()<<"\n"
+						<<"debugirc_channel_lines_total"<<label<<channel.GetLineCount()<<"\n"
+						<<"debugirc_channel_bytes_total"<<label<<channel.GetByteCount()<<"\n"
+						<<"debugirc_channel_deliveries_total"<<label<<channel.GetDeliveryCount()<<"\n"
+						<<"debugirc_channel_unrendered_total"<<label<<channel.GetUnrenderedCount()<<"\n"
+						<<"debugirc_channel_suppressed_total"<<label<<channel.GetSuppressedCount()<<"\n";
+					if(const JournalPtr & journal = channel.GetJournal())
+						ostr<<"debugirc_channel_journal_sequence"<<label<<journal->GetNextSequence() - 1<<"\n"
+							<<"debugirc_channel_journal_failures_total"<<label<<journal->GetFailureCount()<<"\n";
+					channel.GetLatency().WriteMetrics(ostr, "debugirc_channel_latency_seconds",
+							"channel=\"" + EscapeLabel(it->first) + "\"");
+				}
+			}
+			ParticipantSet::Snapshot participants = participants_.Get();
+			for(ParticipantSet::List::const_iterator it = participants->begin(); it != participants->end(); ++it)
+			{
+				ParticipantStats stats;
+				if(!(*it)->GetStats(stats))
+					continue;
+				const std::string label = "{session=\"" + EscapeLabel(stats.name) + "\"} ";
+				ostr<<"debugirc_session_queued_messages"<<label<<stats.queued_messages<<"\n"
+					<<"debugirc_session_queued_bytes"<<label<<stats.queued_bytes<<"\n"
+					<<"debugirc_session_sent_messages_total"<<label<<stats.sent_messages<<"\n"
+					<<"debugirc_session_sent_bytes_total"<<label<<stats.sent_bytes<<"\n"
+					<<"debugirc_session_dropped_messages_total"<<label<<stats.dropped_messages<<"\n";
+				if(stats.latency)
+					stats.latency->WriteMetrics(ostr, "debugirc_session_latency_seconds",
+							"session=\"" + EscapeLabel(stats.name) + "\"");
+			}
+		}
+
 
 	private:
+		static std::string EscapeLabel(const std::string & value)
+		{
+			std::string escaped;
+			for(std::string::const_iterator it = value.begin(); it != value.end(); ++it)
+			{
+				if(*it == '"' || *it == '\\')
+					escaped += '\\';
+				if(*it != '\n' && *it != '\r')
+					escaped += *it;
+			}
+			return escaped;
+		}
+
+		struct IngestRecord
+			: public MpscQueueNode
+		{
+			// plain line, kept in record_.message
+			IngestRecord(const std::string & channel, const std::string & msg, boost::uint64_t produced)
+				: structured_(false),
+					produced_(produced)
+			{
+				record_.channel = channel;
+				record_.message = msg;
+			}
+			IngestRecord(const LogRecord & record, boost::uint64_t produced)
+				: record_(record),
+					structured_(true),
+					produced_(produced)
+			{}
+			LogRecord record_;
+			bool structured_;
+			boost::uint64_t produced_;
+		};
+
+		void PushIngest(IngestRecord * record)
+		{
+			ingest_queue_.Push(record);
+			if(!ingest_scheduled_.load(boost::memory_order_acquire) &&
+					!ingest_scheduled_.exchange(true, boost::memory_order_acq_rel))
+				ingest_service_->post(boost::bind(&Chat::DrainIngestQueue, this));
+		}
+
+		// single consumer, ingest_scheduled_ guarantees only one drain is
+		// queued on the io_service at any time
+		void DrainIngestQueue()
+		{
+			for(size_t i = 0; i < IngestBatch; ++i)
+			{
+				IngestRecord * record = ingest_queue_.Pop();
+				if(!record)
+					break;
+				if(record->structured_)
+					DeliverRecordNow(record->record_, record->produced_);
+				else
+					DeliverChannelNow(record->record_.channel, record->record_.message, record->produced_);
+				delete record;
+			}
+			ingest_scheduled_.store(false, boost::memory_order_release);
+			// a producer may have pushed after the last Pop and seen the flag set
+			if(!ingest_queue_.Empty() && !ingest_scheduled_.exchange(true, boost::memory_order_acq_rel))
+				ingest_service_->post(boost::bind(&Chat::DrainIngestQueue, this));
+		}
+
+		void DeliverChannelNow(const std::string & name, const std::string & msg, boost::uint64_t produced)
+		{
+			if(ChannelPtr channel = GetOrCreateChannel(name))
+				channel->DeliverLine(msg, produced);
+		}
+
+		void DeliverRecordNow(const LogRecord & record, boost::uint64_t produced)
+		{
+			if(ChannelPtr channel = GetOrCreateChannel(record.channel))
+				channel->DeliverRecord(record, produced);
+		}
+
+		// called with channel_sync_ held
+		ChannelTree * FindTree(const std::string & name) const
+		{
+			for(std::vector<ChannelTreePtr>::const_iterator it = trees_.begin(); it != trees_.end(); ++it)
+				if((*it)->Contains(name))
+					return it->get();
+			return 0;
+		}
+
+		// called with channel_sync_ held exclusively. channels below a tree
+		// get their route, an existing channel of the same name is kept
+		void InsertChannel(const ChannelPtr & channel)
+		{
+			channel->SetServerName(server_name_);
+			std::vector<SubscriptionSetPtr> route;
+			if(ChannelTree * tree = FindTree(channel->GetName()))
+				if(tree->GetRoute(channel->GetName(), route))
+					channel->SetRoute(route);
+			channels_.insert(std::make_pair(channel->GetName(), channel));
+		}
+
+		SubscriptionSetPtr GetWildcard(const std::string & name, bool create)
+		{
+			const std::string prefix(name, 0, name.length() - 2);
+			if(!create)
+			{
+				boost::shared_lock<boost::shared_mutex> lock(channel_sync_);
+				ChannelTree * tree = FindTree(prefix);
+				return tree ? tree->GetWildcard(name, false) : SubscriptionSetPtr();
+			}
+			boost::unique_lock<boost::shared_mutex> lock(channel_sync_);
+			ChannelTree * tree = FindTree(prefix);
+			return tree ? tree->GetWildcard(name, true) : SubscriptionSetPtr();
+		}
+
 		// should not be changed after server started up
 		std::string server_name_;
 		std::string motd_start_;
 		std::string motd_;
 		std::string auto_join_;
+		size_t write_batch_limit_;
+		size_t send_queue_bytes_;
+		size_t send_queue_messages_;
+		SendQueuePolicy send_queue_policy_;
+		size_t control_queue_bytes_;
 		AuthManagerPtr auth_manager_;
 		MessageHandlerPtr message_handler_;
+		HandlerPool * handler_pool_;
 		// can be changed after server startup
 		ChannelMap channels_;
+		std::vector<ChannelTreePtr> trees_;
 		mutable boost::shared_mutex channel_sync_;
-		std::set<ChatParticipantPtr> participants_;
-		boost::shared_mutex participant_sync_;
+		ParticipantSet participants_;
+		boost::asio::io_service * ingest_service_;
+		MpscQueue<IngestRecord> ingest_queue_;
+		boost::atomic<bool> ingest_scheduled_;
+		ChatMetrics metrics_;
+		TraceSampler trace_sampler_;
 	};
 } // namespace debugirc
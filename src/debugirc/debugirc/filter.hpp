@@ -0,0 +1,169 @@
+/* filter.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cctype>
+#include <boost/shared_ptr.hpp>
+#include <boost/regex.hpp>
+#include "types.hpp"
+
+namespace debugirc
+{
+	enum FilterKind
+	{
+		FilterSubstring, // pattern occurs anywhere in the line
+		FilterPrefix, // line starts with pattern
+		FilterLevel, // first word of the line equals pattern, ignoring case
+		FilterRegex // boost::regex_search
+	};
+
+	// single match rule, regular expressions are compiled once on creation
+	class FilterRule
+	{
+	public:
+		// throws boost::regex_error for an invalid FilterRegex pattern
+		FilterRule(FilterKind kind, const std::string & pattern)
+			: kind_(kind),
+				pattern_(pattern)
+		{
+			if(kind_ == FilterRegex)
+				regex_.reset(new boost::regex(pattern_, boost::regex::perl | boost::regex::optimize));
+		}
+
+		FilterKind GetKind() const { return kind_; }
+		const std::string & GetPattern() const { return pattern_; }
+
+		bool Match(const char * begin, const char * end) const
+		{
+			const size_t length = end - begin;
+			switch(kind_)
+			{
+			case FilterSubstring:
+				return FindSubstring(begin, length);
+			case FilterPrefix:
+				return length >= pattern_.length() && std::memcmp(begin, pattern_.data(), pattern_.length()) == 0;
+			case FilterLevel:
+				return MatchLevel(begin, length);
+			case FilterRegex:
+				return boost::regex_search(begin, end, *regex_);
+			}
+			return false;
+		}
+
+	private:
+		// memchr for the first byte is vectorized by the C library, the rest
+		// is only compared at candidate positions
+		bool FindSubstring(const char * text, size_t length) const
+		{
+			const size_t needle = pattern_.length();
+			if(needle == 0)
+				return true;
+			if(needle > length)
+				return false;
+			const char first = pattern_[0];
+			const char * last = text + length - needle;
+			for(const char * pos = text; pos <= last; ++pos)
+			{
+				pos = static_cast<const char *>(std::memchr(pos, first, last - pos + 1));
+				if(!pos)
+					return false;
+				if(std::memcmp(pos + 1, pattern_.data() + 1, needle - 1) == 0)
+					return true;
+			}
+			return false;
+		}
+
+		bool MatchLevel(const char * text, size_t length) const
+		{
+			size_t word = 0;
+			while(word < length && text[word] != ' ' && text[word] != '\t')
+				++word;
+			if(word != pattern_.length())
+				return false;
+			for(size_t i = 0; i < word; ++i)
+				if(std::toupper(static_cast<unsigned char>(text[i])) != std::toupper(static_cast<unsigned char>(pattern_[i])))
+					return false;
+			return true;
+		}
+
+		FilterKind kind_;
+		std::string pattern_;
+		boost::shared_ptr<boost::regex> regex_;
+	};
+
+	// immutable set of rules attached to one subscription, a line passes if
+	// any rule matches. it is shared between delivering threads, changes
+	// publish a new set
+	class FilterSet
+	{
+	public:
+		typedef std::vector<FilterRule> Rules;
+
+		explicit FilterSet(const Rules & rules)
+			: rules_(rules)
+		{}
+
+		const Rules & GetRules() const { return rules_; }
+
+		bool Match(const char * begin, const char * end) const
+		{
+			for(Rules::const_iterator it = rules_.begin(); it != rules_.end(); ++it)
+				if(it->Match(begin, end))
+					return true;
+			return false;
+		}
+
+		// returns msg itself if every line passes, an empty pointer if none
+		// does and otherwise a new message holding only the passing lines.
+		// lines starting with prefix are matched without it
+		ChatMessage Apply(const ChatMessage & msg, const std::string & prefix) const
+		{
+			const char * text = msg->data();
+			const char * end = text + msg->length();
+			std::string passed;
+			bool all = true;
+			for(const char * line = text; line < end; )
+			{
+				const char * eol = static_cast<const char *>(std::memchr(line, '\n', end - line));
+				const char * next = eol ? eol + 1 : end;
+				const char * body = line;
+				if(static_cast<size_t>(next - line) >= prefix.length() &&
+						std::memcmp(line, prefix.data(), prefix.length()) == 0)
+					body += prefix.length();
+				const char * body_end = eol ? eol : end;
+				if(body_end > body && body_end[-1] == '\r')
+					--body_end;
+				if(Match(body, body_end))
+				{
+					if(!all)
+						passed.append(line, next);
+				}
+				else if(all)
+				{
+					all = false;
+					passed.assign(text, line);
+				}
+				line = next;
+			}
+			if(all)
+				return msg;
+			if(passed.empty())
+				return ChatMessage();
+			ChatMessage filtered(Message::Create(passed));
+			filtered->SetProduced(msg->GetProduced());
+			filtered->SetDispatched(msg->GetDispatched());
+			return filtered;
+		}
+
+	private:
+		Rules rules_;
+	};
+
+	typedef boost::shared_ptr<const FilterSet> FilterSetPtr;
+} // namespace debugirc
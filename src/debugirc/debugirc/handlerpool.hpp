@@ -0,0 +1,97 @@
+/* handlerpool.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include "metrics.hpp"
+
+namespace debugirc
+{
+	// worker threads for MessageHandler::Handle, so a slow handler does not
+	// stall the io thread of the session that sent the command. sessions
+	// post through a strand of their own, commands of one session run in
+	// order while different sessions run in parallel. at most max_pending
+	// commands are queued or running, further ones are refused
+	class HandlerPool
+		: private boost::noncopyable
+	{
+	public:
+		// threads of 0 means one per hardware thread
+		explicit HandlerPool(size_t threads = 0, size_t max_pending = 1024)
+			: threads_count_(threads ? threads : boost::thread::hardware_concurrency()),
+				max_pending_(max_pending),
+				pending_(0)
+		{
+			if(threads_count_ == 0)
+				threads_count_ = 1;
+			work_.reset(new boost::asio::io_service::work(io_service_));
+		}
+
+		~HandlerPool()
+		{
+			Stop();
+		}
+
+		void Start()
+		{
+			for(size_t i = 0; i < threads_count_; ++i)
+				threads_.create_thread(boost::bind(&HandlerPool::Run, &io_service_));
+		}
+
+		// commands still queued are dropped
+		void Stop()
+		{
+			work_.reset();
+			io_service_.stop();
+			threads_.join_all();
+		}
+
+		boost::asio::io_service & GetIoService() { return io_service_; }
+
+		// reserves room for one command, false if the pool is full
+		bool Acquire()
+		{
+			if(pending_.fetch_add(1, boost::memory_order_relaxed) >= max_pending_)
+			{
+				pending_.fetch_sub(1, boost::memory_order_relaxed);
+				rejected_.Add();
+				return false;
+			}
+			return true;
+		}
+
+		// called once the command acquired for has run
+		void Release()
+		{
+			pending_.fetch_sub(1, boost::memory_order_relaxed);
+			handled_.Add();
+		}
+
+		size_t GetPendingCount() const { return pending_.load(boost::memory_order_relaxed); }
+		boost::uint64_t GetHandledCount() const { return handled_.Get(); }
+		boost::uint64_t GetRejectedCount() const { return rejected_.Get(); }
+
+	private:
+		static void Run(boost::asio::io_service * io_service)
+		{
+			io_service->run();
+		}
+
+		size_t threads_count_;
+		const size_t max_pending_;
+		boost::asio::io_service io_service_;
+		boost::scoped_ptr<boost::asio::io_service::work> work_;
+		boost::thread_group threads_;
+		boost::atomic<size_t> pending_;
+		Counter handled_;
+		Counter rejected_;
+	};
+} // namespace debugirc
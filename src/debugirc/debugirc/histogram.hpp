@@ -0,0 +1,115 @@
+/* histogram.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace debugirc
+{
+	// log-linear histogram in the spirit of HdrHistogram: exact below 64,
+	// then 32 sub buckets per power of two (about 3% relative error).
+	// Record is wait free and may be called from any thread
+	class Histogram
+		: private boost::noncopyable
+	{
+	public:
+		static const int SubBucketBits = 5;
+		static const int SubBuckets = 1 << SubBucketBits;
+		static const int BucketCount = (64 - SubBucketBits) * SubBuckets + SubBuckets;
+
+		Histogram()
+			: total_(0),
+				max_(0)
+		{
+			for(int i = 0; i < BucketCount; ++i)
+				counts_[i].store(0, boost::memory_order_relaxed);
+		}
+
+		void Record(boost::uint64_t value)
+		{
+			counts_[BucketIndex(value)].fetch_add(1, boost::memory_order_relaxed);
+			total_.fetch_add(1, boost::memory_order_relaxed);
+			boost::uint64_t max = max_.load(boost::memory_order_relaxed);
+			while(value > max && !max_.compare_exchange_weak(max, value, boost::memory_order_relaxed))
+			{}
+		}
+
+		void Merge(const Histogram & other)
+		{
+			for(int i = 0; i < BucketCount; ++i)
+			{
+				boost::uint64_t count = other.counts_[i].load(boost::memory_order_relaxed);
+				if(count)
+					counts_[i].fetch_add(count, boost::memory_order_relaxed);
+			}
+			total_.fetch_add(other.GetCount(), boost::memory_order_relaxed);
+			boost::uint64_t value = other.GetMax();
+			boost::uint64_t max = max_.load(boost::memory_order_relaxed);
+			while(value > max && !max_.compare_exchange_weak(max, value, boost::memory_order_relaxed))
+			{}
+		}
+
+		void Reset()
+		{
+			for(int i = 0; i < BucketCount; ++i)
+				counts_[i].store(0, boost::memory_order_relaxed);
+			total_.store(0, boost::memory_order_relaxed);
+			max_.store(0, boost::memory_order_relaxed);
+		}
+
+		boost::uint64_t GetCount() const { return total_.load(boost::memory_order_relaxed); }
+		boost::uint64_t GetMax() const { return max_.load(boost::memory_order_relaxed); }
+
+		// lower bound of the bucket holding the given quantile (0..1)
+		boost::uint64_t GetPercentile(double quantile) const
+		{
+			const boost::uint64_t total = GetCount();
+			if(total == 0)
+				return 0;
+			boost::uint64_t rank = static_cast<boost::uint64_t>(quantile * total);
+			if(rank >= total)
+				rank = total - 1;
+			boost::uint64_t seen = 0;
+			for(int i = 0; i < BucketCount; ++i)
+			{
+				seen += counts_[i].load(boost::memory_order_relaxed);
+				if(seen > rank)
+					return BucketValue(i);
+			}
+			return GetMax();
+		}
+
+	private:
+		static int BucketIndex(boost::uint64_t value)
+		{
+			if(value < 2 * SubBuckets)
+				return static_cast<int>(value);
+#if defined(__GNUC__)
+			int msb = 63 - __builtin_clzll(value);
+#else
+			int msb = 0;
+			for(boost::uint64_t v = value; v >>= 1; )
+				++msb;
+#endif
+			int shift = msb - SubBucketBits;
+			return shift * SubBuckets + static_cast<int>(value >> shift);
+		}
+
+		static boost::uint64_t BucketValue(int index)
+		{
+			if(index < 2 * SubBuckets)
+				return index;
+			int shift = index / SubBuckets - 1;
+			return static_cast<boost::uint64_t>(index % SubBuckets + SubBuckets) << shift;
+		}
+
+		boost::atomic<boost::uint64_t> counts_[BucketCount];
+		boost::atomic<boost::uint64_t> total_;
+		boost::atomic<boost::uint64_t> max_;
+	};
+} // namespace debugirc
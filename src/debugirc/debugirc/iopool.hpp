@@ -0,0 +1,90 @@
+/* iopool.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <vector>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace debugirc
+{
+	// one io_service per thread, sessions are pinned to a single io_service
+	// so their handlers never run concurrently with each other
+	class IoServicePool
+		: private boost::noncopyable
+	{
+	public:
+		// pool_size of 0 means one io_service per hardware thread
+		explicit IoServicePool(size_t pool_size = 0)
+			: next_io_service_(0)
+		{
+			if(pool_size == 0)
+				pool_size = boost::thread::hardware_concurrency();
+			if(pool_size == 0)
+				pool_size = 1;
+			for(size_t i = 0; i < pool_size; ++i)
+			{
+				IoServicePtr io_service(new boost::asio::io_service(1));
+				io_services_.push_back(io_service);
+				work_.push_back(WorkPtr(new boost::asio::io_service::work(*io_service)));
+			}
+		}
+
+		~IoServicePool()
+		{
+			Stop();
+		}
+
+		void Start()
+		{
+			for(size_t i = 0; i < io_services_.size(); ++i)
+			{
+				boost::asio::io_service * io_service = io_services_[i].get();
+				threads_.create_thread(boost::bind(&IoServicePool::Run, io_service));
+			}
+		}
+
+		void Stop()
+		{
+			for(size_t i = 0; i < io_services_.size(); ++i)
+				io_services_[i]->stop();
+			threads_.join_all();
+		}
+
+		size_t GetSize() const { return io_services_.size(); }
+
+		boost::asio::io_service & GetIoService(size_t index)
+		{
+			return *io_services_.at(index);
+		}
+
+		// round robin
+		boost::asio::io_service & GetIoService()
+		{
+			size_t index = next_io_service_.fetch_add(1, boost::memory_order_relaxed);
+			return *io_services_[index % io_services_.size()];
+		}
+
+	private:
+		typedef boost::shared_ptr<boost::asio::io_service> IoServicePtr;
+		typedef boost::shared_ptr<boost::asio::io_service::work> WorkPtr;
+
+		static void Run(boost::asio::io_service * io_service)
+		{
+			io_service->run();
+		}
+
+		std::vector<IoServicePtr> io_services_;
+		std::vector<WorkPtr> work_;
+		boost::thread_group threads_;
+		boost::atomic<size_t> next_io_service_;
+	};
+} // namespace debugirc
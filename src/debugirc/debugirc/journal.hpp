@@ -0,0 +1,437 @@
+/* journal.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <stdexcept>
+#include <fstream>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "types.hpp"
+
+namespace debugirc
+{
+	// a segment file starts with JournalMagic padded to JournalFileHeaderSize
+	// and holds records back to back, each a JournalRecordHeader followed by
+	// the line as sent to clients, padded to 8 bytes. the unused tail of a
+	// segment is zero, a record with sequence 0 ends the segment
+	static const char JournalMagic[8] = { 'D', 'I', 'R', 'C', 'J', 'R', 'N', '1' };
+	static const size_t JournalFileHeaderSize = 16;
+
+	struct JournalRecordHeader
+	{
+		boost::uint64_t sequence; // from 1, one per line
+		boost::int64_t time; // microseconds since the unix epoch
+		boost::uint32_t length;
+		boost::uint32_t reserved;
+	};
+
+	inline size_t GetJournalRecordSize(size_t length)
+	{
+		return sizeof(JournalRecordHeader) + ((length + 7) & ~size_t(7));
+	}
+
+	inline boost::int64_t JournalNow()
+	{
+		static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+		return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+	}
+
+	// one mapped segment file. records up to GetEnd() are complete, the
+	// writer publishes them with a release store so readers need no lock
+	class JournalSegment
+		: private boost::noncopyable
+	{
+	public:
+		// throws boost::interprocess::interprocess_exception or
+		// std::exception if the file cannot be created or mapped
+		static boost::shared_ptr<JournalSegment> Create(const std::string & path, boost::uint64_t first_sequence,
+				size_t size)
+		{
+			{
+				std::filebuf file;
+				if(!file.open(path.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::trunc | std::ios_base::binary))
+					throw std::runtime_error("cannot create " + path);
+				file.sputn(JournalMagic, sizeof(JournalMagic));
+				file.pubseekoff(size - 1, std::ios_base::beg);
+				file.sputc(0);
+			}
+			boost::shared_ptr<JournalSegment> segment(new JournalSegment(path, first_sequence, true));
+			segment->end_.store(JournalFileHeaderSize, boost::memory_order_relaxed);
+			return segment;
+		}
+
+		// maps an existing segment and finds the end of its records
+		static boost::shared_ptr<JournalSegment> Open(const std::string & path, boost::uint64_t first_sequence,
+				bool writable)
+		{
+			boost::shared_ptr<JournalSegment> segment(new JournalSegment(path, first_sequence, writable));
+			if(segment->GetCapacity() < JournalFileHeaderSize ||
+					std::memcmp(segment->GetData(), JournalMagic, sizeof(JournalMagic)) != 0)
+				throw std::runtime_error("not a journal segment " + path);
+			size_t offset = JournalFileHeaderSize;
+			JournalRecordHeader header;
+			while(segment->ReadHeader(offset, header))
+				offset += GetJournalRecordSize(header.length);
+			segment->end_.store(offset, boost::memory_order_relaxed);
+			return segment;
+		}
+
+		const std::string & GetPath() const { return path_; }
+		boost::uint64_t GetFirstSequence() const { return first_sequence_; }
+		const char * GetData() const { return static_cast<const char *>(region_.get_address()); }
+		size_t GetCapacity() const { return region_.get_size(); }
+		size_t GetEnd() const { return end_.load(boost::memory_order_acquire); }
+
+		// false past the last record
+		bool ReadHeader(size_t offset, JournalRecordHeader & header) const
+		{
+			if(offset + sizeof(header) > GetCapacity())
+				return false;
+			std::memcpy(&header, GetData() + offset, sizeof(header));
+			return header.sequence != 0 && offset + GetJournalRecordSize(header.length) <= GetCapacity();
+		}
+
+		// writer only, the caller checked the space
+		void Append(boost::uint64_t sequence, boost::int64_t time, const char * data, size_t length)
+		{
+			const size_t offset = end_.load(boost::memory_order_relaxed);
+			char * out = static_cast<char *>(region_.get_address()) + offset;
+			JournalRecordHeader header;
+			header.sequence = sequence;
+			header.time = time;
+			header.length = static_cast<boost::uint32_t>(length);
+			header.reserved = 0;
+			std::memcpy(out + sizeof(header), data, length);
+			std::memcpy(out, &header, sizeof(header));
+			end_.store(offset + GetJournalRecordSize(length), boost::memory_order_release);
+		}
+
+	private:
+		JournalSegment(const std::string & path, boost::uint64_t first_sequence, bool writable)
+			: path_(path),
+				first_sequence_(first_sequence),
+				mapping_(path.c_str(), writable ? boost::interprocess::read_write : boost::interprocess::read_only),
+				region_(mapping_, writable ? boost::interprocess::read_write : boost::interprocess::read_only),
+				end_(0)
+		{}
+
+		std::string path_;
+		boost::uint64_t first_sequence_;
+		boost::interprocess::file_mapping mapping_;
+		boost::interprocess::mapped_region region_;
+		boost::atomic<size_t> end_;
+	};
+
+	typedef boost::shared_ptr<JournalSegment> JournalSegmentPtr;
+
+	class Journal;
+	typedef boost::shared_ptr<Journal> JournalPtr;
+
+	// reads the lines of a journal from a start point up to the sequence
+	// the journal had reached when the cursor was created
+	class JournalCursor
+		: private boost::noncopyable
+	{
+	public:
+		JournalCursor(const JournalPtr & journal, const JournalSegmentPtr & segment,
+				boost::uint64_t from_sequence, boost::int64_t from_time, boost::uint64_t stop_sequence)
+			: journal_(journal),
+				segment_(segment),
+				offset_(JournalFileHeaderSize),
+				from_sequence_(from_sequence),
+				from_time_(from_time),
+				stop_sequence_(stop_sequence),
+				next_sequence_(segment ? segment->GetFirstSequence() : stop_sequence)
+		{}
+
+		// appends whole lines until out holds at least max_bytes, returns
+		// false once the stop sequence is reached
+		inline bool Read(std::string & out, size_t max_bytes);
+
+		boost::uint64_t GetNextSequence() const { return next_sequence_; }
+		boost::uint64_t GetStopSequence() const { return stop_sequence_; }
+
+	private:
+		JournalPtr journal_;
+		JournalSegmentPtr segment_;
+		size_t offset_;
+		boost::uint64_t from_sequence_;
+		boost::int64_t from_time_;
+		boost::uint64_t stop_sequence_;
+		boost::uint64_t next_sequence_;
+	};
+
+	typedef boost::shared_ptr<JournalCursor> JournalCursorPtr;
+
+	// append only log of one channel in memory mapped segment files named
+	// <name>.<first sequence>.journal. appending a line is a memcpy into
+	// the mapping, files are only created, mapped and removed on rotation.
+	// errors never reach the delivering thread, they are counted and the
+	// lines are lost
+	class Journal
+		: public boost::enable_shared_from_this<Journal>,
+			private boost::noncopyable
+	{
+	public:
+		static const size_t MinSegmentBytes = 64 * 1024;
+
+		// segment_seconds of 0 rotates on size only, max_segments of 0
+		// keeps every segment
+		Journal(const std::string & directory, const std::string & name, size_t segment_bytes,
+				size_t segment_seconds, size_t max_segments)
+			: directory_(directory),
+				name_(GetFileName(name)),
+				segment_bytes_((segment_bytes > MinSegmentBytes ? segment_bytes : MinSegmentBytes) & ~size_t(7)),
+				segment_microseconds_(boost::int64_t(segment_seconds) * 1000000),
+				max_segments_(max_segments),
+				active_time_(0),
+				next_sequence_(1),
+				failures_(0)
+		{
+			try
+			{
+				boost::filesystem::create_directories(directory_);
+				Recover();
+			}
+			catch(const std::exception &)
+			{
+				failures_.fetch_add(1, boost::memory_order_relaxed);
+			}
+		}
+
+		void Append(const ChatMessage & msg)
+		{
+			const boost::int64_t now = JournalNow();
+			const char * text = msg->data();
+			const char * end = text + msg->length();
+			boost::unique_lock<boost::mutex> lock(sync_);
+			while(text < end)
+			{
+				const char * eol = static_cast<const char *>(std::memchr(text, '\n', end - text));
+				const char * next = eol ? eol + 1 : end;
+				AppendLine(now, text, next - text);
+				text = next;
+			}
+		}
+
+		boost::uint64_t GetNextSequence() const
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			return next_sequence_;
+		}
+
+		boost::uint64_t GetFailureCount() const { return failures_.load(boost::memory_order_relaxed); }
+
+		// lines from the given sequence and time on, whichever is later,
+		// up to the current end of the journal. 0 for either means from the
+		// oldest line kept
+		JournalCursorPtr GetCursor(boost::uint64_t from_sequence, boost::int64_t from_time)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			// every line before a segment that starts late enough is skipped
+			size_t index = 0;
+			for(size_t i = 1; i < segments_.size(); ++i)
+				if(segments_[i].first_sequence <= from_sequence || segments_[i].first_time <= from_time)
+					index = i;
+			return JournalCursorPtr(new JournalCursor(shared_from_this(),
+						segments_.empty() ? JournalSegmentPtr() : OpenSegment(index),
+						from_sequence, from_time, next_sequence_));
+		}
+
+		// the segment following the one starting at first_sequence, empty
+		// if there is none or it was removed meanwhile
+		JournalSegmentPtr GetSegmentAfter(boost::uint64_t first_sequence)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			for(size_t i = 0; i < segments_.size(); ++i)
+				if(segments_[i].first_sequence > first_sequence)
+					return OpenSegment(i);
+			return JournalSegmentPtr();
+		}
+
+	private:
+		struct SegmentInfo
+		{
+			std::string path;
+			boost::uint64_t first_sequence;
+			boost::int64_t first_time;
+		};
+
+		// channel names may hold characters that are not safe in a path
+		static std::string GetFileName(const std::string & name)
+		{
+			std::string file_name(name);
+			for(std::string::iterator it = file_name.begin(); it != file_name.end(); ++it)
+				if(!std::isalnum(static_cast<unsigned char>(*it)) && *it != '-' && *it != '_' && *it != '.')
+					*it = '_';
+			return file_name;
+		}
+
+		std::string GetSegmentPath(boost::uint64_t first_sequence) const
+		{
+			char sequence[24];
+			std::snprintf(sequence, sizeof(sequence), "%020llu", static_cast<unsigned long long>(first_sequence));
+			return (boost::filesystem::path(directory_) / (name_ + "." + sequence + ".journal")).string();
+		}
+
+		static bool CompareSegments(const SegmentInfo & a, const SegmentInfo & b)
+		{
+			return a.first_sequence < b.first_sequence;
+		}
+
+		// picks up the segments of a previous run, appending continues in
+		// the last one
+		void Recover()
+		{
+			const std::string prefix = name_ + ".";
+			const std::string suffix = ".journal";
+			for(boost::filesystem::directory_iterator it(directory_), end; it != end; ++it)
+			{
+				const std::string file_name = it->path().filename().string();
+				if(file_name.length() != prefix.length() + 20 + suffix.length() ||
+						file_name.compare(0, prefix.length(), prefix) != 0 ||
+						file_name.compare(file_name.length() - suffix.length(), suffix.length(), suffix) != 0)
+					continue;
+				SegmentInfo info;
+				info.path = it->path().string();
+				info.first_sequence = std::strtoull(file_name.c_str() + prefix.length(), 0, 10);
+				info.first_time = 0;
+				try
+				{
+					JournalSegmentPtr segment(JournalSegment::Open(info.path, info.first_sequence, false));
+					JournalRecordHeader header;
+					if(!segment->ReadHeader(JournalFileHeaderSize, header))
+						continue;
+					info.first_time = header.time;
+				}
+				catch(const std::exception &)
+				{
+					failures_.fetch_add(1, boost::memory_order_relaxed);
+					continue;
+				}
+				segments_.push_back(info);
+			}
+			std::sort(segments_.begin(), segments_.end(), &Journal::CompareSegments);
+			if(segments_.empty())
+				return;
+			active_ = JournalSegment::Open(segments_.back().path, segments_.back().first_sequence, true);
+			active_time_ = segments_.back().first_time;
+			next_sequence_ = active_->GetFirstSequence();
+			JournalRecordHeader header;
+			for(size_t offset = JournalFileHeaderSize; active_->ReadHeader(offset, header);
+					offset += GetJournalRecordSize(header.length))
+				next_sequence_ = header.sequence + 1;
+		}
+
+		// called with sync_ held
+		void AppendLine(boost::int64_t now, const char * data, size_t length)
+		{
+			const size_t record = GetJournalRecordSize(length);
+			if(record > segment_bytes_ - JournalFileHeaderSize)
+			{
+				failures_.fetch_add(1, boost::memory_order_relaxed);
+				return;
+			}
+			if(!active_ || active_->GetEnd() + record > active_->GetCapacity() ||
+					(segment_microseconds_ && now - active_time_ >= segment_microseconds_))
+				Rotate(now);
+			if(!active_)
+				return;
+			active_->Append(next_sequence_++, now, data, length);
+		}
+
+		// called with sync_ held
+		void Rotate(boost::int64_t now)
+		{
+			active_.reset();
+			SegmentInfo info;
+			info.path = GetSegmentPath(next_sequence_);
+			info.first_sequence = next_sequence_;
+			info.first_time = now;
+			try
+			{
+				active_ = JournalSegment::Create(info.path, next_sequence_, segment_bytes_);
+			}
+			catch(const std::exception &)
+			{
+				failures_.fetch_add(1, boost::memory_order_relaxed);
+				return;
+			}
+			active_time_ = now;
+			segments_.push_back(info);
+			while(max_segments_ && segments_.size() > max_segments_)
+			{
+				boost::system::error_code ignored;
+				boost::filesystem::remove(segments_.front().path, ignored);
+				segments_.erase(segments_.begin());
+			}
+		}
+
+		// the active segment is shared with readers, older ones are mapped
+		// read only for the reader. called with sync_ held
+		JournalSegmentPtr OpenSegment(size_t index)
+		{
+			if(active_ && active_->GetFirstSequence() == segments_[index].first_sequence)
+				return active_;
+			try
+			{
+				return JournalSegment::Open(segments_[index].path, segments_[index].first_sequence, false);
+			}
+			catch(const std::exception &)
+			{
+				return JournalSegmentPtr();
+			}
+		}
+
+		const std::string directory_;
+		const std::string name_;
+		const size_t segment_bytes_;
+		const boost::int64_t segment_microseconds_;
+		const size_t max_segments_;
+		std::vector<SegmentInfo> segments_; // oldest first
+		JournalSegmentPtr active_;
+		boost::int64_t active_time_;
+		boost::uint64_t next_sequence_;
+		boost::atomic<boost::uint64_t> failures_;
+		mutable boost::mutex sync_;
+	};
+
+	inline bool JournalCursor::Read(std::string & out, size_t max_bytes)
+	{
+		while(out.size() < max_bytes && next_sequence_ < stop_sequence_ && segment_)
+		{
+			JournalRecordHeader header;
+			if(offset_ + sizeof(header) > segment_->GetEnd() || !segment_->ReadHeader(offset_, header))
+			{
+				segment_ = journal_->GetSegmentAfter(segment_->GetFirstSequence());
+				offset_ = JournalFileHeaderSize;
+				continue;
+			}
+			if(header.sequence >= from_sequence_ && header.time >= from_time_)
+				out.append(segment_->GetData() + offset_ + sizeof(header), header.length);
+			next_sequence_ = header.sequence + 1;
+			offset_ += GetJournalRecordSize(header.length);
+		}
+		if(!segment_)
+			next_sequence_ = stop_sequence_;
+		return next_sequence_ < stop_sequence_;
+	}
+} // namespace debugirc
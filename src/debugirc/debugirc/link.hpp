@@ -0,0 +1,548 @@
+/* link.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include "types.hpp"
+#include "participant.hpp"
+#include "channel.hpp"
+#include "chat.hpp"
+#include "iopool.hpp"
+
+namespace debugirc
+{
+	using boost::asio::ip::tcp;
+
+	// server to server link. a leaf forwards channels to a hub over one TCP
+	// stream of frames <uint32 length><uint8 type><payload>, integers in
+	// network byte order, length counting type and payload
+	enum LinkFrameType
+	{
+		LinkHello = 1, // leaf name
+		LinkChannel = 2, // uint16 channel id, channel name
+		LinkLines = 3 // uint16 channel id, lines without the IRC prefix
+	};
+
+	static const size_t LinkHeaderSize = 5;
+	static const size_t LinkMaxFrame = 16 * 1024 * 1024;
+
+	inline void AppendLinkHeader(std::string & out, LinkFrameType type, size_t payload)
+	{
+		const boost::uint32_t length = static_cast<boost::uint32_t>(payload + 1);
+		const char header[LinkHeaderSize] = {
+			static_cast<char>(length >> 24), static_cast<char>(length >> 16),
+			static_cast<char>(length >> 8), static_cast<char>(length),
+			static_cast<char>(type) };
+		out.append(header, LinkHeaderSize);
+	}
+
+	inline void AppendLinkId(std::string & out, boost::uint16_t id)
+	{
+		const char bytes[2] = { static_cast<char>(id >> 8), static_cast<char>(id) };
+		out.append(bytes, 2);
+	}
+
+	inline boost::uint32_t ReadLinkUint(const char * data, size_t bytes)
+	{
+		boost::uint32_t value = 0;
+		for(size_t i = 0; i < bytes; ++i)
+			value = (value << 8) | static_cast<unsigned char>(data[i]);
+		return value;
+	}
+
+	// leaf side. lines delivered to forwarded channels are appended as
+	// frames to one pending buffer, every write takes the whole buffer so
+	// the link batches by itself while a write is in flight. the buffer is
+	// bounded, lines beyond it are dropped and counted. the connection is
+	// retried every second until Stop
+	class LinkClient
+		: public boost::enable_shared_from_this<LinkClient>,
+			private boost::noncopyable
+	{
+	public:
+		static const size_t DefaultMaxPending = 8 * 1024 * 1024;
+
+		LinkClient(boost::asio::io_service & io_service, Chat & chat,
+				const std::string & name, const tcp::endpoint & hub)
+			: strand_(io_service),
+				socket_(io_service),
+				retry_timer_(io_service),
+				chat_(chat),
+				name_(name),
+				hub_(hub),
+				max_pending_(DefaultMaxPending),
+				connected_(false),
+				writing_(false),
+				stopped_(false),
+				dropped_(0)
+		{}
+
+		~LinkClient()
+		{
+			LeaveChannels();
+		}
+
+		void SetMaxPending(size_t bytes)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			max_pending_ = bytes;
+		}
+
+		// starts forwarding a local channel, returns false if there is no
+		// such channel or it is forwarded already
+		bool Forward(const std::string & channel_name)
+		{
+			ChannelPtr channel = chat_.GetChannel(channel_name);
+			if(!channel)
+				return false;
+			ChatParticipantPtr forwarder;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				for(size_t i = 0; i < forwarders_.size(); ++i)
+					if(forwarders_[i].first == channel_name)
+						return false;
+				const boost::uint16_t id = static_cast<boost::uint16_t>(forwarders_.size());
+				forwarder.reset(new Forwarder(shared_from_this(), id, channel));
+				forwarders_.push_back(std::make_pair(channel_name, forwarder));
+				// declared before any of its lines
+				if(connected_)
+					AppendChannel(pending_, id, channel_name);
+			}
+			return chat_.JoinChannel(channel_name, forwarder);
+		}
+
+		void Start()
+		{
+			strand_.dispatch(boost::bind(&LinkClient::Connect, shared_from_this()));
+		}
+
+		void Stop()
+		{
+			LeaveChannels();
+			strand_.dispatch(boost::bind(&LinkClient::HandleStop, shared_from_this()));
+		}
+
+		bool IsConnected() const
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			return connected_;
+		}
+
+		boost::uint64_t GetDroppedCount() const
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			return dropped_;
+		}
+
+	private:
+		class Forwarder
+			: public ChatParticipant
+		{
+		public:
+			Forwarder(const boost::shared_ptr<LinkClient> & client, boost::uint16_t id, const ChannelPtr & channel)
+				: client_(client),
+					id_(id),
+					channel_(channel)
+			{}
+
+			virtual void Deliver(const ChatMessage & msg)
+			{
+				if(boost::shared_ptr<LinkClient> client = client_.lock())
+					client->Append(id_, channel_->GetPrefix(), msg);
+			}
+
+		private:
+			boost::weak_ptr<LinkClient> client_;
+			boost::uint16_t id_;
+			ChannelPtr channel_;
+		};
+
+		typedef std::vector<std::pair<std::string, ChatParticipantPtr> > Forwarders;
+
+		static void AppendChannel(std::string & out, boost::uint16_t id, const std::string & name)
+		{
+			AppendLinkHeader(out, LinkChannel, 2 + name.length());
+			AppendLinkId(out, id);
+			out += name;
+		}
+
+		// one LinkLines frame per message, the channel prefix is stripped from
+		// every line so the hub can put its own
+		void Append(boost::uint16_t id, const std::string & prefix, const ChatMessage & msg)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			if(pending_.size() + LinkHeaderSize + 2 + msg->length() > max_pending_)
+			{
+				++dropped_;
+				return;
+			}
+			const size_t header = pending_.size();
+			AppendLinkHeader(pending_, LinkLines, 0);
+			AppendLinkId(pending_, id);
+			const char * text = msg->data();
+			const char * end = text + msg->length();
+			while(text < end)
+			{
+				const char * eol = static_cast<const char *>(std::memchr(text, '\n', end - text));
+				const char * next = eol ? eol + 1 : end;
+				if(static_cast<size_t>(next - text) > prefix.length() &&
+						std::memcmp(text, prefix.data(), prefix.length()) == 0)
+					text += prefix.length();
+				pending_.append(text, next);
+				if(!eol)
+					pending_ += '\n';
+				text = next;
+			}
+			std::string length;
+			AppendLinkHeader(length, LinkLines, pending_.size() - header - LinkHeaderSize);
+			pending_.replace(header, LinkHeaderSize, length);
+			if(connected_ && !writing_)
+			{
+				writing_ = true;
+				strand_.post(boost::bind(&LinkClient::StartWrite, shared_from_this()));
+			}
+		}
+
+		void LeaveChannels()
+		{
+			Forwarders forwarders;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				forwarders.swap(forwarders_);
+			}
+			for(Forwarders::const_iterator it = forwarders.begin(); it != forwarders.end(); ++it)
+				chat_.LeaveChannel(it->first, it->second);
+		}
+
+		// everything below runs in strand_
+		void Connect()
+		{
+			if(stopped_)
+				return;
+			socket_.async_connect(hub_, strand_.wrap(boost::bind(&LinkClient::HandleConnect,
+							shared_from_this(), boost::asio::placeholders::error)));
+		}
+
+		void HandleConnect(const boost::system::error_code & error)
+		{
+			if(error || stopped_)
+			{
+				Retry();
+				return;
+			}
+			boost::system::error_code ignored;
+			socket_.set_option(tcp::no_delay(true), ignored);
+			{
+				// hello and channel declarations go ahead of lines that
+				// piled up while disconnected
+				boost::unique_lock<boost::mutex> lock(sync_);
+				std::string handshake;
+				AppendLinkHeader(handshake, LinkHello, name_.length());
+				handshake += name_;
+				for(size_t i = 0; i < forwarders_.size(); ++i)
+					AppendChannel(handshake, static_cast<boost::uint16_t>(i), forwarders_[i].first);
+				pending_.insert(0, handshake);
+				connected_ = true;
+				writing_ = true;
+			}
+			StartWrite();
+			// the hub never sends, a completed read means the link is gone
+			socket_.async_read_some(boost::asio::buffer(read_buffer_),
+					strand_.wrap(boost::bind(&LinkClient::HandleRead, shared_from_this(),
+							boost::asio::placeholders::error)));
+		}
+
+		void StartWrite()
+		{
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(!connected_)
+					return;
+				if(pending_.empty())
+				{
+					writing_ = false;
+					return;
+				}
+				writing_buffer_.swap(pending_);
+				pending_.clear();
+			}
+			boost::asio::async_write(socket_, boost::asio::buffer(writing_buffer_),
+					strand_.wrap(boost::bind(&LinkClient::HandleWrite, shared_from_this(),
+							boost::asio::placeholders::error)));
+		}
+
+		void HandleWrite(const boost::system::error_code & error)
+		{
+			writing_buffer_.clear();
+			if(error)
+			{
+				Disconnect();
+				return;
+			}
+			StartWrite();
+		}
+
+		void HandleRead(const boost::system::error_code & error)
+		{
+			if(error != boost::asio::error::operation_aborted)
+				Disconnect();
+		}
+
+		void Disconnect()
+		{
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(!connected_)
+					return;
+				connected_ = false;
+				writing_ = false;
+			}
+			boost::system::error_code ignored;
+			socket_.close(ignored);
+			Retry();
+		}
+
+		void Retry()
+		{
+			if(stopped_)
+				return;
+			boost::system::error_code ignored;
+			socket_.close(ignored);
+			retry_timer_.expires_from_now(boost::posix_time::seconds(1));
+			retry_timer_.async_wait(strand_.wrap(boost::bind(&LinkClient::HandleRetry,
+							shared_from_this(), boost::asio::placeholders::error)));
+		}
+
+		void HandleRetry(const boost::system::error_code & error)
+		{
+			if(!error)
+				Connect();
+		}
+
+		void HandleStop()
+		{
+			stopped_ = true;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				connected_ = false;
+			}
+			boost::system::error_code ignored;
+			retry_timer_.cancel(ignored);
+			socket_.close(ignored);
+		}
+
+		boost::asio::io_service::strand strand_;
+		tcp::socket socket_;
+		boost::asio::deadline_timer retry_timer_;
+		Chat & chat_;
+		std::string name_;
+		tcp::endpoint hub_;
+		size_t max_pending_;
+		bool connected_;
+		bool writing_;
+		bool stopped_; // strand only
+		boost::uint64_t dropped_;
+		Forwarders forwarders_;
+		std::string pending_;
+		std::string writing_buffer_; // strand only
+		boost::array<char, 64> read_buffer_;
+		mutable boost::mutex sync_;
+	};
+
+	typedef boost::shared_ptr<LinkClient> LinkClientPtr;
+
+	// hub side. every leaf channel is republished as #<leaf>/<channel>,
+	// created on first use with the given config
+	class LinkServer
+		: private boost::noncopyable
+	{
+	public:
+		LinkServer(boost::asio::io_service & io_service, Chat & chat,
+				const tcp::endpoint & endpoint, const ChannelConfig & config = ChannelConfig(),
+				IoServicePool * pool = 0)
+			: io_service_(io_service),
+				pool_(pool),
+				acceptor_(io_service, endpoint),
+				chat_(chat),
+				config_(config)
+		{
+			StartAccept();
+		}
+
+		tcp::endpoint GetEndpoint() const { return acceptor_.local_endpoint(); }
+
+	private:
+		class Connection
+			: public boost::enable_shared_from_this<Connection>
+		{
+		public:
+			static const size_t ReadSize = 64 * 1024;
+
+			Connection(boost::asio::io_service & io_service, Chat & chat, const ChannelConfig & config)
+				: socket_(io_service),
+					chat_(chat),
+					config_(config),
+					buffer_(ReadSize),
+					length_(0)
+			{}
+
+			tcp::socket & GetSocket() { return socket_; }
+
+			void Start()
+			{
+				StartRead();
+			}
+
+		private:
+			// only one read is outstanding, so no strand is needed
+			void StartRead()
+			{
+				if(buffer_.size() - length_ < ReadSize / 4)
+					buffer_.resize(buffer_.size() * 2);
+				socket_.async_read_some(boost::asio::buffer(&buffer_[length_], buffer_.size() - length_),
+						boost::bind(&Connection::HandleRead, shared_from_this(),
+							boost::asio::placeholders::error,
+							boost::asio::placeholders::bytes_transferred));
+			}
+
+			void HandleRead(const boost::system::error_code & error, size_t bytes_transferred)
+			{
+				if(error)
+					return;
+				length_ += bytes_transferred;
+				size_t offset = 0;
+				while(length_ - offset >= LinkHeaderSize)
+				{
+					const char * frame = &buffer_[offset];
+					const size_t length = ReadLinkUint(frame, 4);
+					if(length == 0 || length > LinkMaxFrame)
+						return Close();
+					if(length_ - offset < 4 + length)
+						break;
+					if(!HandleFrame(static_cast<unsigned char>(frame[4]), frame + LinkHeaderSize, length - 1))
+						return Close();
+					offset += 4 + length;
+				}
+				if(offset)
+				{
+					std::memmove(&buffer_[0], &buffer_[offset], length_ - offset);
+					length_ -= offset;
+				}
+				if(length_ == 0 && buffer_.size() > ReadSize)
+					std::vector<char>(ReadSize).swap(buffer_);
+				StartRead();
+			}
+
+			bool HandleFrame(unsigned char type, const char * payload, size_t length)
+			{
+				switch(type)
+				{
+				case LinkHello:
+					leaf_.assign(payload, length);
+					return !leaf_.empty() && leaf_.find_first_of(" ,\r\n") == std::string::npos;
+				case LinkChannel:
+					{
+						if(leaf_.empty() || length < 3 || payload[2] != '#')
+							return false;
+						const size_t id = ReadLinkUint(payload, 2);
+						const std::string name(payload + 2, length - 2);
+						if(id >= channels_.size())
+							channels_.resize(id + 1);
+						channels_[id] = chat_.FindOrAddChannel("#" + leaf_ + "/" + name.substr(1),
+								"linked from " + leaf_, config_);
+						return true;
+					}
+				case LinkLines:
+					{
+						if(length < 3 || payload[length - 1] != '\n')
+							return false;
+						const size_t id = ReadLinkUint(payload, 2);
+						if(id >= channels_.size() || !channels_[id])
+							return false;
+						DeliverLines(*channels_[id], payload + 2, payload + length);
+						return true;
+					}
+				}
+				return false;
+			}
+
+			// renders the lines of one frame into a single message
+			static void DeliverLines(Channel & channel, const char * text, const char * end)
+			{
+				if(text == end || !channel.HasConsumers())
+					return;
+				const std::string & prefix = channel.GetPrefix();
+				const size_t lines = std::count(text, end, '\n');
+				char * out = 0;
+				ChatMessage msg(Message::Create(lines * prefix.length() + (end - text), out));
+				while(text < end)
+				{
+					const char * next = static_cast<const char *>(std::memchr(text, '\n', end - text)) + 1;
+					std::memcpy(out, prefix.data(), prefix.length());
+					out += prefix.length();
+					std::memcpy(out, text, next - text);
+					out += next - text;
+					text = next;
+				}
+				channel.Deliver(msg);
+			}
+
+			void Close()
+			{
+				boost::system::error_code ignored;
+				socket_.close(ignored);
+			}
+
+			tcp::socket socket_;
+			Chat & chat_;
+			ChannelConfig config_;
+			std::vector<char> buffer_;
+			size_t length_;
+			std::string leaf_;
+			std::vector<ChannelPtr> channels_;
+		};
+
+		typedef boost::shared_ptr<Connection> ConnectionPtr;
+
+		void StartAccept()
+		{
+			boost::asio::io_service & service = pool_ ? pool_->GetIoService() : io_service_;
+			ConnectionPtr connection(new Connection(service, chat_, config_));
+			acceptor_.async_accept(connection->GetSocket(),
+					boost::bind(&LinkServer::HandleAccept, this, connection,
+						boost::asio::placeholders::error));
+		}
+
+		void HandleAccept(ConnectionPtr connection, const boost::system::error_code & error)
+		{
+			if(error)
+				return;
+			boost::system::error_code ignored;
+			connection->GetSocket().set_option(tcp::no_delay(true), ignored);
+			connection->Start();
+			StartAccept();
+		}
+
+		boost::asio::io_service & io_service_;
+		IoServicePool * pool_;
+		tcp::acceptor acceptor_;
+		Chat & chat_;
+		ChannelConfig config_;
+	};
+} // namespace debugirc
@@ -0,0 +1,118 @@
+/* message.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <new>
+#include <string>
+#include <cstring>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace debugirc
+{
+	class Message;
+	typedef boost::intrusive_ptr<Message> ChatMessage;
+
+	// immutable wire ready text shared by every session it is queued to.
+	// header, reference count and text live in a single heap block
+	class Message
+		: private boost::noncopyable
+	{
+	public:
+		static ChatMessage Create(const char * data, size_t length)
+		{
+			Message * msg = Allocate(length);
+			std::memcpy(msg->Text(), data, length);
+			return ChatMessage(msg);
+		}
+
+		static ChatMessage Create(const std::string & text)
+		{
+			return Create(text.data(), text.length());
+		}
+
+		// renders head + body + tail with a single allocation
+		static ChatMessage Create(const std::string & head, const std::string & body, const char * tail)
+		{
+			const size_t tail_length = std::strlen(tail);
+			Message * msg = Allocate(head.length() + body.length() + tail_length);
+			char * out = msg->Text();
+			std::memcpy(out, head.data(), head.length());
+			out += head.length();
+			std::memcpy(out, body.data(), body.length());
+			out += body.length();
+			std::memcpy(out, tail, tail_length);
+			return ChatMessage(msg);
+		}
+
+		// uninitialized text of the given length, the caller fills it through
+		// text before the message is shared
+		static ChatMessage Create(size_t length, char *& text)
+		{
+			Message * msg = Allocate(length);
+			text = msg->Text();
+			return ChatMessage(msg);
+		}
+
+		const char * c_str() const { return Text(); }
+		const char * data() const { return Text(); }
+		size_t length() const { return length_; }
+		bool empty() const { return length_ == 0; }
+		const boost::posix_time::ptime & GetCreated() const { return created_; }
+
+		// TraceNow() stamps of sampled lines, 0 if the line is not traced.
+		// only set by the single thread owning the message before it is shared
+		bool IsTraced() const { return produced_ != 0; }
+		boost::uint64_t GetProduced() const { return produced_; }
+		void SetProduced(boost::uint64_t value) { produced_ = value; }
+		boost::uint64_t GetDispatched() const { return dispatched_; }
+		void SetDispatched(boost::uint64_t value) { dispatched_ = value; }
+
+		friend void intrusive_ptr_add_ref(Message * msg)
+		{
+			msg->refs_.fetch_add(1, boost::memory_order_relaxed);
+		}
+
+		friend void intrusive_ptr_release(Message * msg)
+		{
+			if(msg->refs_.fetch_sub(1, boost::memory_order_release) == 1)
+			{
+				boost::atomic_thread_fence(boost::memory_order_acquire);
+				msg->~Message();
+				::operator delete(msg);
+			}
+		}
+
+	private:
+		explicit Message(size_t length)
+			: refs_(0),
+				length_(length),
+				created_(boost::posix_time::microsec_clock::universal_time()),
+				produced_(0),
+				dispatched_(0)
+		{}
+
+		static Message * Allocate(size_t length)
+		{
+			void * block = ::operator new(sizeof(Message) + length + 1);
+			Message * msg = new(block) Message(length);
+			msg->Text()[length] = '\0';
+			return msg;
+		}
+
+		char * Text() { return reinterpret_cast<char *>(this + 1); }
+		const char * Text() const { return reinterpret_cast<const char *>(this + 1); }
+
+		boost::atomic<long> refs_;
+		size_t length_;
+		boost::posix_time::ptime created_;
+		boost::uint64_t produced_;
+		boost::uint64_t dispatched_;
+	};
+} // namespace debugirc
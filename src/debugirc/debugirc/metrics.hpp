@@ -0,0 +1,55 @@
+/* metrics.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace debugirc
+{
+	static const size_t CacheLineSize = 64;
+
+	// monotonically increasing value. updates are relaxed and every counter
+	// sits on its own cache line so hot counters do not false share
+	class Counter
+		: private boost::noncopyable
+	{
+	public:
+		Counter() : value_(0) {}
+		void Add(boost::uint64_t value = 1) { value_.fetch_add(value, boost::memory_order_relaxed); }
+		boost::uint64_t Get() const { return value_.load(boost::memory_order_relaxed); }
+	private:
+		boost::atomic<boost::uint64_t> value_;
+		char padding_[CacheLineSize - sizeof(boost::atomic<boost::uint64_t>)];
+	};
+
+	// value that goes up and down, e.g. queued bytes
+	class Gauge
+		: private boost::noncopyable
+	{
+	public:
+		Gauge() : value_(0) {}
+		void Add(boost::int64_t value) { value_.fetch_add(value, boost::memory_order_relaxed); }
+		void Sub(boost::int64_t value) { value_.fetch_sub(value, boost::memory_order_relaxed); }
+		boost::int64_t Get() const { return value_.load(boost::memory_order_relaxed); }
+	private:
+		boost::atomic<boost::int64_t> value_;
+		char padding_[CacheLineSize - sizeof(boost::atomic<boost::int64_t>)];
+	};
+
+	// totals shared by all sessions of a chat
+	struct ChatMetrics
+	{
+		Counter sessions_accepted;
+		Gauge sessions_active;
+		Gauge queued_messages;
+		Gauge queued_bytes;
+		Counter sent_messages;
+		Counter sent_bytes;
+		Counter dropped_messages;
+	};
+} // namespace debugirc
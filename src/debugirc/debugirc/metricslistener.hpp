@@ -0,0 +1,104 @@
+/* metricslistener.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include "chat.hpp"
+
+namespace debugirc
+{
+	using boost::asio::ip::tcp;
+
+	// minimal HTTP/1.0 endpoint answering every request with the chat
+	// metrics, meant for prometheus style scrapers
+	class MetricsListener
+	{
+	public:
+		MetricsListener(boost::asio::io_service & io_service,
+				const tcp::endpoint & endpoint, const Chat & chat)
+			: io_service_(io_service),
+				acceptor_(io_service, endpoint),
+				chat_(chat)
+		{
+			StartAccept();
+		}
+
+		tcp::endpoint GetEndpoint() const { return acceptor_.local_endpoint(); }
+
+	private:
+		class Connection
+			: public boost::enable_shared_from_this<Connection>
+		{
+		public:
+			Connection(boost::asio::io_service & io_service, const Chat & chat)
+				: socket_(io_service),
+					chat_(chat)
+			{}
+
+			tcp::socket & GetSocket() { return socket_; }
+
+			void Start()
+			{
+				boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+						boost::bind(&Connection::HandleRead, shared_from_this(),
+							boost::asio::placeholders::error));
+			}
+
+		private:
+			void HandleRead(const boost::system::error_code & error)
+			{
+				if(error)
+					return;
+				std::ostringstream body;
+				chat_.WriteMetrics(body);
+				response_ = "HTTP/1.0 200 OK\r\n"
+					"Content-Type: text/plain; version=0.0.4\r\n"
+					"Connection: close\r\n\r\n" + body.str();
+				boost::asio::async_write(socket_, boost::asio::buffer(response_),
+						boost::bind(&Connection::HandleWrite, shared_from_this(),
+							boost::asio::placeholders::error));
+			}
+
+			void HandleWrite(const boost::system::error_code &)
+			{
+				boost::system::error_code ignored;
+				socket_.shutdown(tcp::socket::shutdown_both, ignored);
+				socket_.close(ignored);
+			}
+
+			tcp::socket socket_;
+			const Chat & chat_;
+			boost::asio::streambuf request_;
+			std::string response_;
+		};
+
+		typedef boost::shared_ptr<Connection> ConnectionPtr;
+
+		void StartAccept()
+		{
+			ConnectionPtr connection(new Connection(io_service_, chat_));
+			acceptor_.async_accept(connection->GetSocket(),
+					boost::bind(&MetricsListener::HandleAccept, this, connection,
+						boost::asio::placeholders::error));
+		}
+
+		void HandleAccept(ConnectionPtr connection, const boost::system::error_code & error)
+		{
+			if(error)
+				return;
+			connection->Start();
+			StartAccept();
+		}
+
+		boost::asio::io_service & io_service_;
+		tcp::acceptor acceptor_;
+		const Chat & chat_;
+	};
+} // namespace debugirc
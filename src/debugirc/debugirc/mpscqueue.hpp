@@ -0,0 +1,92 @@
+/* mpscqueue.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace debugirc
+{
+	class MpscQueueNode
+	{
+	public:
+		MpscQueueNode() : next_(0) {}
+	private:
+		template<class T> friend class MpscQueue;
+		boost::atomic<MpscQueueNode *> next_;
+	};
+
+	// intrusive multi producer single consumer queue (D. Vyukov).
+	// Push is wait free and may be called from any thread, Pop must only be
+	// called by one consumer at a time. T has to derive from MpscQueueNode,
+	// the queue never owns its elements.
+	template<class T>
+	class MpscQueue
+		: private boost::noncopyable
+	{
+	public:
+		MpscQueue()
+			: head_(&stub_),
+				tail_(&stub_)
+		{}
+
+		void Push(T * item)
+		{
+			Push(static_cast<MpscQueueNode *>(item));
+		}
+
+		// returns 0 if the queue is empty or a producer is in the middle of
+		// a push, in the latter case the item becomes visible shortly
+		T * Pop()
+		{
+			MpscQueueNode * tail = tail_;
+			MpscQueueNode * next = tail->next_.load(boost::memory_order_acquire);
+			if(tail == &stub_)
+			{
+				if(!next)
+					return 0;
+				tail_ = next;
+				tail = next;
+				next = next->next_.load(boost::memory_order_acquire);
+			}
+			if(next)
+			{
+				tail_ = next;
+				return static_cast<T *>(tail);
+			}
+			if(tail != head_.load(boost::memory_order_acquire))
+				return 0;
+			Push(&stub_);
+			next = tail->next_.load(boost::memory_order_acquire);
+			if(next)
+			{
+				tail_ = next;
+				return static_cast<T *>(tail);
+			}
+			return 0;
+		}
+
+		// consumer side only
+		bool Empty() const
+		{
+			return tail_ == &stub_ &&
+				!stub_.next_.load(boost::memory_order_acquire) &&
+				head_.load(boost::memory_order_acquire) == &stub_;
+		}
+
+	private:
+		void Push(MpscQueueNode * node)
+		{
+			node->next_.store(0, boost::memory_order_relaxed);
+			MpscQueueNode * prev = head_.exchange(node, boost::memory_order_acq_rel);
+			prev->next_.store(node, boost::memory_order_release);
+		}
+
+		boost::atomic<MpscQueueNode *> head_;
+		MpscQueueNode * tail_;
+		MpscQueueNode stub_;
+	};
+} // namespace debugirc
@@ -5,17 +5,109 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/cstdint.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include "types.hpp"
+#include "trace.hpp"
 
 namespace debugirc
 {
+	struct ParticipantStats
+	{
+		ParticipantStats()
+			: queued_messages(0),
+				queued_bytes(0),
+				sent_messages(0),
+				sent_bytes(0),
+				dropped_messages(0)
+		{}
+
+		std::string name;
+		size_t queued_messages;
+		size_t queued_bytes;
+		boost::uint64_t sent_messages;
+		boost::uint64_t sent_bytes;
+		boost::uint64_t dropped_messages;
+		// stage latencies of traced lines, empty if none were sampled yet
+		boost::shared_ptr<const LatencyStats> latency;
+	};
+
 	class ChatParticipant
 	{
 	public:
 		virtual ~ChatParticipant() {}
 		virtual void Deliver(const ChatMessage& msg) = 0;
+		// participants without a send queue have nothing to report
+		virtual bool GetStats(ParticipantStats & stats) const { return false; }
 	};
 
 	typedef boost::shared_ptr<ChatParticipant> ChatParticipantPtr;
+
+	// read-copy-update set of participants. readers grab an immutable flat
+	// snapshot without locking, Insert and Erase publish a new copy
+	class ParticipantSet
+		: private boost::noncopyable
+	{
+	public:
+		typedef std::vector<ChatParticipantPtr> List;
+		typedef boost::shared_ptr<const List> Snapshot;
+
+		ParticipantSet()
+			: list_(new List())
+		{}
+
+		Snapshot Get() const
+		{
+			return boost::atomic_load(&list_);
+		}
+
+		bool Insert(const ChatParticipantPtr & participant)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			if(std::find(list_->begin(), list_->end(), participant) != list_->end())
+				return false;
+			boost::shared_ptr<List> list(new List());
+			list->reserve(list_->size() + 1);
+			list->assign(list_->begin(), list_->end());
+			list->push_back(participant);
+			boost::atomic_store(&list_, Snapshot(list));
+			return true;
+		}
+
+		void Erase(const ChatParticipantPtr & participant)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			List::const_iterator it = std::find(list_->begin(), list_->end(), participant);
+			if(it == list_->end())
+				return;
+			boost::shared_ptr<List> list(new List());
+			list->reserve(list_->size() - 1);
+			list->insert(list->end(), list_->begin(), it);
+			list->insert(list->end(), it + 1, list_->end());
+			boost::atomic_store(&list_, Snapshot(list));
+		}
+
+		size_t GetSize() const
+		{
+			return Get()->size();
+		}
+
+		// visits the current snapshot
+		template<class F>
+		void ForEach(F f) const
+		{
+			Snapshot snapshot = Get();
+			std::for_each(snapshot->begin(), snapshot->end(), f);
+		}
+
+	private:
+		Snapshot list_;
+		boost::mutex sync_;
+	};
 } // namespace debugirc
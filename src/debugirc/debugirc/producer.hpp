@@ -0,0 +1,227 @@
+/* producer.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "types.hpp"
+#include "channel.hpp"
+
+namespace debugirc
+{
+	// buffers lines per writing thread and hands them to the channel as one
+	// multi line message every max_lines lines or max_delay, whichever comes
+	// first. the delay is checked on Write and, if an io_service is given,
+	// by a timer so idle threads do not keep lines forever
+	class Producer
+		: private boost::noncopyable
+	{
+	public:
+		Producer(const ChannelPtr & channel, size_t max_lines,
+				const boost::posix_time::time_duration & max_delay,
+				boost::asio::io_service * io_service = 0)
+			: state_(new State(channel, max_lines ? max_lines : 1, max_delay))
+		{
+			if(io_service && !max_delay.is_special() && max_delay.ticks() > 0)
+			{
+				state_->timer_.reset(new boost::asio::deadline_timer(*io_service));
+				ArmTimer(state_);
+			}
+		}
+
+		~Producer()
+		{
+			if(state_->timer_)
+				state_->timer_->cancel();
+			FlushAll();
+		}
+
+		// lines written while the channel has neither subscribers nor a
+		// backlog are dropped without being rendered
+		void Write(const std::string & line)
+		{
+			const Channel & channel = *state_->channel_;
+			if(!channel.HasConsumers())
+				return;
+			Buffer & buffer = GetBuffer();
+			boost::unique_lock<boost::mutex> lock(buffer.sync_);
+			buffer.pending_ += channel.GetPrefix();
+			buffer.pending_ += line;
+			buffer.pending_ += '\n';
+			Written(buffer);
+		}
+
+		void Write(const LogRecord & record)
+		{
+			const Channel & channel = *state_->channel_;
+			if(!channel.HasConsumers())
+				return;
+			Buffer & buffer = GetBuffer();
+			boost::unique_lock<boost::mutex> lock(buffer.sync_);
+			RenderRecord(record, channel.GetPrefix(), buffer.pending_);
+			Written(buffer);
+		}
+
+		// flushes the calling thread's buffer
+		void Flush()
+		{
+			LocalBuffer * local = local_.get();
+			if(local && local->state_ == state_)
+				FlushBuffer(*state_, *local->buffer_);
+		}
+
+		// flushes the buffers of all threads
+		void FlushAll()
+		{
+			FlushAll(*state_);
+		}
+
+		const ChannelPtr & GetChannel() const { return state_->channel_; }
+		// lock free, callers can skip building a line nobody would see
+		bool HasConsumers() const { return state_->channel_->HasConsumers(); }
+
+	private:
+		struct Buffer
+		{
+			Buffer() : lines_(0) {}
+			boost::mutex sync_;
+			std::string pending_;
+			size_t lines_;
+			boost::posix_time::ptime first_;
+		};
+		typedef boost::shared_ptr<Buffer> BufferPtr;
+
+		struct State
+		{
+			State(const ChannelPtr & channel, size_t max_lines,
+					const boost::posix_time::time_duration & max_delay)
+				: channel_(channel),
+					max_lines_(max_lines),
+					max_delay_(max_delay)
+			{}
+			ChannelPtr channel_;
+			size_t max_lines_;
+			boost::posix_time::time_duration max_delay_;
+			boost::mutex sync_;
+			std::vector<boost::weak_ptr<Buffer> > buffers_;
+			boost::scoped_ptr<boost::asio::deadline_timer> timer_;
+		};
+		typedef boost::shared_ptr<State> StatePtr;
+
+		// thread local handle, flushes whatever is left when the thread exits
+		struct LocalBuffer
+		{
+			explicit LocalBuffer(const StatePtr & state)
+				: state_(state),
+					buffer_(new Buffer())
+			{
+				boost::unique_lock<boost::mutex> lock(state_->sync_);
+				std::vector<boost::weak_ptr<Buffer> > & buffers = state_->buffers_;
+				for(size_t i = 0; i < buffers.size(); ++i)
+				{
+					if(buffers[i].expired())
+					{
+						buffers[i] = buffer_;
+						return;
+					}
+				}
+				buffers.push_back(buffer_);
+			}
+			~LocalBuffer()
+			{
+				FlushBuffer(*state_, *buffer_);
+			}
+			StatePtr state_;
+			BufferPtr buffer_;
+		};
+
+		Buffer & GetBuffer()
+		{
+			LocalBuffer * local = local_.get();
+			// the key may be reused by a producer living at the same address
+			if(!local || local->state_ != state_)
+			{
+				local = new LocalBuffer(state_);
+				local_.reset(local);
+			}
+			return *local->buffer_;
+		}
+
+		// called with the buffer lock held after a line was appended
+		void Written(Buffer & buffer)
+		{
+			const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+			if(buffer.lines_++ == 0)
+				buffer.first_ = now;
+			if(buffer.lines_ >= state_->max_lines_ || now - buffer.first_ >= state_->max_delay_)
+				FlushLocked(*state_, buffer);
+		}
+
+		static void FlushLocked(State & state, Buffer & buffer)
+		{
+			if(buffer.pending_.empty())
+				return;
+			ChatMessage msg(Message::Create(buffer.pending_));
+			buffer.pending_.clear();
+			buffer.lines_ = 0;
+			// delivered under the buffer lock to keep batches of a thread ordered
+			state.channel_->Deliver(msg);
+		}
+
+		static void FlushBuffer(State & state, Buffer & buffer)
+		{
+			boost::unique_lock<boost::mutex> lock(buffer.sync_);
+			FlushLocked(state, buffer);
+		}
+
+		static void FlushAll(State & state)
+		{
+			std::vector<BufferPtr> buffers;
+			{
+				boost::unique_lock<boost::mutex> lock(state.sync_);
+				for(size_t i = 0; i < state.buffers_.size(); ++i)
+				{
+					BufferPtr buffer = state.buffers_[i].lock();
+					if(buffer)
+						buffers.push_back(buffer);
+				}
+			}
+			for(size_t i = 0; i < buffers.size(); ++i)
+				FlushBuffer(state, *buffers[i]);
+		}
+
+		static void ArmTimer(const StatePtr & state)
+		{
+			state->timer_->expires_from_now(state->max_delay_);
+			state->timer_->async_wait(boost::bind(&Producer::HandleFlushTimer, state,
+						boost::asio::placeholders::error));
+		}
+
+		static void HandleFlushTimer(StatePtr state, const boost::system::error_code & error)
+		{
+			if(!error)
+			{
+				FlushAll(*state);
+				ArmTimer(state);
+			}
+		}
+
+		StatePtr state_;
+		boost::thread_specific_ptr<LocalBuffer> local_;
+	};
+
+	typedef boost::shared_ptr<Producer> ProducerPtr;
+} // namespace debugirc
@@ -0,0 +1,48 @@
+/* ratelimit.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace debugirc
+{
+	// token bucket in its GCRA form: a single atomic holds the theoretical
+	// arrival time of the next line, so Admit is lock free. times are
+	// nanoseconds of a monotonic clock, see TraceNow()
+	class RateLimiter
+		: private boost::noncopyable
+	{
+	public:
+		RateLimiter(size_t lines_per_second, size_t burst)
+			: interval_(1000000000ull / (lines_per_second ? lines_per_second : 1)),
+				limit_(interval_ * (burst ? burst : 1)),
+				tat_(0)
+		{}
+
+		// takes cost tokens, returns false if the bucket does not hold them.
+		// a cost above the burst size passes only when the bucket is full
+		bool Admit(boost::uint64_t now, size_t cost = 1)
+		{
+			const boost::uint64_t increment = interval_ * cost;
+			boost::uint64_t tat = tat_.load(boost::memory_order_relaxed);
+			for(;;)
+			{
+				const boost::uint64_t start = tat > now ? tat : now;
+				if(start + increment - now > limit_ && start != now)
+					return false;
+				if(tat_.compare_exchange_weak(tat, start + increment, boost::memory_order_relaxed))
+					return true;
+			}
+		}
+
+	private:
+		const boost::uint64_t interval_;
+		const boost::uint64_t limit_;
+		boost::atomic<boost::uint64_t> tat_;
+	};
+} // namespace debugirc
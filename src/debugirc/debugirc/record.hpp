@@ -0,0 +1,84 @@
+/* record.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace debugirc
+{
+	// structured log line. the library renders it only when a channel has
+	// someone to deliver it to, so callers can hand over the raw fields
+	struct LogRecord
+	{
+		LogRecord()
+			: timestamp(boost::posix_time::microsec_clock::universal_time())
+		{}
+
+		LogRecord(const std::string & channel_, const std::string & level_,
+				const std::string & logger_, const std::string & message_)
+			: timestamp(boost::posix_time::microsec_clock::universal_time()),
+				channel(channel_),
+				level(level_),
+				logger(logger_),
+				message(message_)
+		{}
+
+		boost::posix_time::ptime timestamp;
+		std::string channel;
+		std::string level;
+		std::string logger;
+		std::string message;
+	};
+
+	// Out targets for RenderRecord
+	struct RenderLength
+	{
+		RenderLength() : length(0) {}
+		void append(const char *, size_t count) { length += count; }
+		size_t length;
+	};
+
+	struct RenderBuffer
+	{
+		explicit RenderBuffer(char * out_) : out(out_) {}
+		void append(const char * data, size_t count) { std::memcpy(out, data, count); out += count; }
+		char * out;
+	};
+
+	// IRC wire form "<prefix>LEVEL logger - text\n", one line per line of
+	// the message since a PRIVMSG cannot span lines. Out needs
+	// append(const char *, size_t), e.g. std::string
+	template<class Out>
+	void RenderRecord(const LogRecord & record, const std::string & prefix, Out & out)
+	{
+		const char * text = record.message.data();
+		const char * end = text + record.message.length();
+		do
+		{
+			const char * eol = static_cast<const char *>(std::memchr(text, '\n', end - text));
+			const char * line_end = eol ? eol : end;
+			if(line_end > text && line_end[-1] == '\r')
+				--line_end;
+			out.append(prefix.data(), prefix.length());
+			if(!record.level.empty())
+			{
+				out.append(record.level.data(), record.level.length());
+				out.append(" ", 1);
+			}
+			if(!record.logger.empty())
+			{
+				out.append(record.logger.data(), record.logger.length());
+				out.append(" - ", 3);
+			}
+			out.append(text, line_end - text);
+			out.append("\n", 1);
+			text = eol ? eol + 1 : end;
+		}
+		while(text < end);
+	}
+} // namespace debugirc
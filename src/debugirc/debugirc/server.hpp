@@ -5,50 +5,237 @@
 
 #pragma once
 
+#include <vector>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include "types.hpp"
 #include "participant.hpp"
 #include "chat.hpp"
 #include "session.hpp"
+#include "sessionpool.hpp"
+#include "iopool.hpp"
+#include "metricslistener.hpp"
+#include "link.hpp"
 
 namespace debugirc
 {
 	using boost::asio::ip::tcp;
+
+	struct ServerConfig
+	{
+		ServerConfig()
+			: max_sessions(0),
+				accepts(4),
+				reuse_port(false),
+				idle_sessions(16)
+		{}
+
+		size_t max_sessions; // connected sessions, 0 for no limit
+		size_t accepts; // outstanding async_accepts per acceptor
+		bool reuse_port; // one SO_REUSEPORT acceptor per io_service of the pool
+		size_t idle_sessions; // reset sessions kept for reuse, per io_service
+	};
+
 	class Server
 	{
 	public:
 		Server(boost::asio::io_service& io_service,
-				const tcp::endpoint& endpoint)
+				const tcp::endpoint& endpoint,
+				const ServerConfig & config = ServerConfig())
 			: io_service_(io_service),
-				acceptor_(io_service, endpoint)
+				pool_(0),
+				config_(config),
+				sessions_(0),
+				paused_(0),
+				next_pool_(0)
 		{
-			SessionPtr new_session(new Session(io_service_, chat_));
-			acceptor_.async_accept(new_session->GetSocket(),
-					boost::bind(&Server::HandleAccept, this, new_session,
-						boost::asio::placeholders::error));
+			AddAcceptor(io_service_, endpoint, false, 0);
+			session_pools_.push_back(MakeSessionPool(io_service_));
+			StartAccepting();
 		}
 
-		void HandleAccept(SessionPtr current_session,
+		// sessions are spread round robin over the io_services of the pool,
+		// with reuse_port each io_service accepts its own sessions
+		Server(IoServicePool & pool,
+				const tcp::endpoint& endpoint,
+				const ServerConfig & config = ServerConfig())
+			: io_service_(pool.GetIoService(0)),
+				pool_(&pool),
+				config_(config),
+				sessions_(0),
+				paused_(0),
+				next_pool_(0)
+		{
+#ifdef SO_REUSEPORT
+			const bool reuse_port = config_.reuse_port;
+#else
+			const bool reuse_port = false;
+#endif
+			AddAcceptor(io_service_, endpoint, reuse_port, reuse_port ? 0 : -1);
+			// port 0 picks the port once, the others share it
+			const tcp::endpoint bound = acceptors_[0]->acceptor.local_endpoint();
+			for(size_t i = 1; reuse_port && i < pool.GetSize(); ++i)
+				AddAcceptor(pool.GetIoService(i), bound, true, i);
+			for(size_t i = 0; i < pool.GetSize(); ++i)
+				session_pools_.push_back(MakeSessionPool(pool.GetIoService(i)));
+			StartAccepting();
+		}
+
+		Chat & GetChat() { return chat_; }
+
+		// actual listening endpoint, useful when bound to port 0
+		tcp::endpoint GetEndpoint() const { return acceptors_[0]->acceptor.local_endpoint(); }
+
+		// connected sessions plus outstanding accepts
+		size_t GetSessionCount() const { return sessions_.load(boost::memory_order_relaxed); }
+
+		// serves WriteMetrics over plain HTTP on a separate port
+		void StartMetricsListener(const tcp::endpoint & endpoint)
+		{
+			metrics_listener_.reset(new MetricsListener(io_service_, endpoint, chat_));
+		}
+
+		// accepts leaf servers and republishes their channels as
+		// #<leaf>/<channel>, created with the given config
+		void StartLinkListener(const tcp::endpoint & endpoint, const ChannelConfig & config = ChannelConfig())
+		{
+			link_server_.reset(new LinkServer(io_service_, chat_, endpoint, config, pool_));
+		}
+
+		// links this server as a leaf to a hub, channels are picked with
+		// LinkClient::Forward
+		LinkClientPtr ConnectHub(const std::string & name, const tcp::endpoint & hub)
+		{
+			LinkClientPtr client(new LinkClient(io_service_, chat_, name, hub));
+			link_clients_.push_back(client);
+			client->Start();
+			return client;
+		}
+
+		~Server()
+		{
+			for(size_t i = 0; i < link_clients_.size(); ++i)
+				link_clients_[i]->Stop();
+		}
+
+	private:
+		// paused counts accepts that were not re-armed because max_sessions
+		// was reached, both it and the accepts run in the strand
+		struct Acceptor
+		{
+			Acceptor(boost::asio::io_service & io_service, int session_pool_)
+				: acceptor(io_service),
+					strand(io_service),
+					session_pool(session_pool_),
+					paused(0)
+			{}
+
+			tcp::acceptor acceptor;
+			boost::asio::io_service::strand strand;
+			int session_pool; // -1 for round robin
+			size_t paused;
+		};
+		typedef boost::shared_ptr<Acceptor> AcceptorPtr;
+
+		void AddAcceptor(boost::asio::io_service & io_service, const tcp::endpoint & endpoint,
+				bool reuse_port, int session_pool)
+		{
+			AcceptorPtr acceptor(new Acceptor(io_service, session_pool));
+			acceptor->acceptor.open(endpoint.protocol());
+			acceptor->acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+			if(reuse_port)
+				acceptor->acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+			acceptor->acceptor.bind(endpoint);
+			acceptor->acceptor.listen();
+			acceptors_.push_back(acceptor);
+		}
+
+		SessionPoolPtr MakeSessionPool(boost::asio::io_service & io_service)
+		{
+			return SessionPoolPtr(new SessionPool(io_service, chat_, config_.idle_sessions,
+						boost::bind(&Server::HandleRelease, this)));
+		}
+
+		void StartAccepting()
+		{
+			const size_t accepts = config_.accepts ? config_.accepts : 1;
+			// interleaved, so a small max_sessions is not taken up by the
+			// first acceptor alone
+			for(size_t j = 0; j < accepts; ++j)
+				for(size_t i = 0; i < acceptors_.size(); ++i)
+					acceptors_[i]->strand.post(boost::bind(&Server::StartAccept, this, acceptors_[i].get()));
+		}
+
+		// a session slot is taken before the accept is posted, so accepts in
+		// flight never push the count past max_sessions
+		void StartAccept(Acceptor * acceptor)
+		{
+			const size_t sessions = sessions_.fetch_add(1, boost::memory_order_acq_rel);
+			if(config_.max_sessions && sessions >= config_.max_sessions)
+			{
+				sessions_.fetch_sub(1, boost::memory_order_acq_rel);
+				++acceptor->paused;
+				paused_.fetch_add(1, boost::memory_order_acq_rel);
+				// a session may have been released before paused_ was raised
+				if(sessions_.load(boost::memory_order_acquire) < config_.max_sessions)
+					acceptor->strand.post(boost::bind(&Server::ResumeAccept, this, acceptor));
+				return;
+			}
+			const int index = acceptor->session_pool >= 0 ? acceptor->session_pool :
+				static_cast<int>(next_pool_.fetch_add(1, boost::memory_order_relaxed) % session_pools_.size());
+			SessionPtr new_session(session_pools_[index]->Acquire());
+			acceptor->acceptor.async_accept(new_session->GetSocket(),
+					acceptor->strand.wrap(boost::bind(&Server::HandleAccept, this, acceptor, new_session,
+						boost::asio::placeholders::error)));
+		}
+
+		void HandleAccept(Acceptor * acceptor, SessionPtr current_session,
 				const boost::system::error_code& error)
 		{
 			if (!error)
 			{
 				current_session->Start();
-				SessionPtr new_session(new Session(io_service_, chat_));
-				acceptor_.async_accept(new_session->GetSocket(),
-						boost::bind(&Server::HandleAccept, this, new_session,
-							boost::asio::placeholders::error));
+				StartAccept(acceptor);
 			}
 		}
 
-		Chat & GetChat() { return chat_; }
+		// called by the session pools on any thread once a session is gone
+		void HandleRelease()
+		{
+			sessions_.fetch_sub(1, boost::memory_order_acq_rel);
+			if(paused_.load(boost::memory_order_acquire) == 0)
+				return;
+			for(size_t i = 0; i < acceptors_.size(); ++i)
+				acceptors_[i]->strand.post(boost::bind(&Server::ResumeAccept, this, acceptors_[i].get()));
+		}
+
+		void ResumeAccept(Acceptor * acceptor)
+		{
+			if(!acceptor->paused)
+				return;
+			--acceptor->paused;
+			paused_.fetch_sub(1, boost::memory_order_acq_rel);
+			StartAccept(acceptor);
+		}
 
-	private:
 		boost::asio::io_service& io_service_;
-		tcp::acceptor acceptor_;
+		IoServicePool * pool_;
+		const ServerConfig config_;
+		std::vector<AcceptorPtr> acceptors_;
+		boost::atomic<size_t> sessions_;
+		boost::atomic<size_t> paused_;
+		boost::atomic<size_t> next_pool_;
 		Chat chat_;
+		boost::scoped_ptr<MetricsListener> metrics_listener_;
+		boost::scoped_ptr<LinkServer> link_server_;
+		std::vector<LinkClientPtr> link_clients_;
+		// last, so released sessions never find the pools half destroyed
+		std::vector<SessionPoolPtr> session_pools_;
 	};
 
 } // namespace debugirc
@@ -6,8 +6,17 @@
 #pragma once
 
 #include <set>
+#include <map>
+#include <deque>
+#include <utility>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
 #include <boost/bind.hpp>
+#include <boost/array.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/asio.hpp>
 #include <boost/unordered_map.hpp>
@@ -16,6 +25,8 @@
 #include "types.hpp"
 #include "participant.hpp"
 #include "chat.hpp"
+#include "filter.hpp"
+#include "timerwheel.hpp"
 
 namespace debugirc
 {
@@ -27,30 +38,32 @@ namespace debugirc
 	{
 	public:
 		static const int PingInterval = 300; // 5 miniutes
+		static const size_t ReceiveBufferSize = 4096;
+		static const size_t ReplayChunkBytes = 64 * 1024;
 
 		Session(boost::asio::io_service& io_service, Chat& room)
-			: socket_(io_service),
+			: io_service_(io_service),
+				strand_(io_service),
+				socket_(io_service),
 				bridge_(room),
+				read_length_(0),
+				discard_line_(false),
+				write_in_progress_(false),
+				queued_bytes_(0),
+				control_bytes_(0),
+				dropped_msgs_(0),
+				dropped_total_(0),
+				sent_messages_(0),
+				sent_bytes_(0),
+				write_started_(0),
+				writing_traced_(false),
+				closed_(false),
 				initialized_(false),
 				authorized_(false),
-				register_timeout_(io_service),
-				connection_timeout_(io_service),
 				closing_connection_(false),
-				ping_sent_(false)
-		{
-			registration_handlers_["NICK"] = &Session::MessageNick;
-			registration_handlers_["PASS"] = &Session::MessagePass;
-			registration_handlers_["USER"] = &Session::MessageUser;
-			message_handlers_["MODE"] = &Session::MessageIgnore;
-			message_handlers_["QUIT"] = &Session::MessageQuit;
-			message_handlers_["PING"] = &Session::MessagePing;
-			message_handlers_["JOIN"] = &Session::MessageJoin;
-			message_handlers_["PART"] = &Session::MessagePart;
-			message_handlers_["LIST"] = &Session::MessageList;
-			message_handlers_["WHO"] = &Session::MessageWho;
-			message_handlers_["PONG"] = &Session::MessagePong;
-			message_handlers_["PRIVMSG"] = &Session::MessagePrivMsg;
-			message_handlers_["NOTICE"] = &Session::MessageIgnore;
+				ping_sent_(false),
+				timers_(boost::asio::use_service<TimerWheel>(io_service))
+		{
 		}
 
 		tcp::socket & GetSocket()
@@ -58,40 +71,275 @@ namespace debugirc
 			return socket_;
 		}
 
+		// returns a finished session to its just constructed state so a
+		// SessionPool can hand it to the next accept. must only be called
+		// once nothing refers to the session any more
+		void Reset()
+		{
+			boost::system::error_code ignored;
+			socket_.close(ignored);
+			timers_.Cancel(register_timeout_);
+			timers_.Cancel(connection_timeout_);
+			read_length_ = 0;
+			discard_line_ = false;
+			ClearQueue();
+			writing_msgs_.clear();
+			write_buffers_.clear();
+			write_in_progress_ = false;
+			dropped_msgs_ = 0;
+			dropped_total_ = 0;
+			sent_messages_ = 0;
+			sent_bytes_ = 0;
+			latency_.reset();
+			write_started_ = 0;
+			writing_traced_ = false;
+			closed_ = false;
+			initialized_ = false;
+			authorized_ = false;
+			nick_.clear();
+			password_.clear();
+			active_channels_.clear();
+			filters_.clear();
+			replay_.reset();
+			replay_channel_.clear();
+			replay_prefix_.clear();
+			replay_filter_.reset();
+			closing_connection_ = false;
+			ping_sent_ = false;
+		}
+
 		void Start()
 		{
-			initialized_ = true;
-			register_timeout_.expires_from_now(boost::posix_time::seconds(5));
-			register_timeout_.async_wait(boost::bind(&Session::HandleRegisterTimeout, shared_from_this(),
-								boost::asio::placeholders::error));
-			bridge_.Join(shared_from_this());
-			boost::asio::async_read_until(socket_, buffer_, '\n',
-				boost::bind(&Session::HandleRead, this,
-								boost::asio::placeholders::error));
+			strand_.post(boost::bind(&Session::HandleStart, shared_from_this()));
 		}
 
 		void Deliver(const std::string & msg)
 		{
 			if(msg.empty())
 				return;
-			ChatMessage info(new std::string(msg));
-			Deliver(info);
+			Deliver(Message::Create(msg));
 		}
 
 		void Deliver(const ChatMessage& msg)
+		{
+			Enqueue(msg, msg && msg->IsTraced());
+		}
+
+		virtual bool GetStats(ParticipantStats & stats) const
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			stats.name = nick_;
+			stats.queued_messages = write_msgs_.size() + control_msgs_.size();
+			stats.queued_bytes = queued_bytes_ + control_bytes_;
+			stats.sent_messages = sent_messages_;
+			stats.sent_bytes = sent_bytes_;
+			stats.dropped_messages = dropped_total_;
+			stats.latency = latency_;
+			return true;
+		}
+
+	private:
+		// trace tells whether the stages of a sampled line are recorded,
+		// replayed backlog lines are old and would only skew the histograms
+		void Enqueue(const ChatMessage& msg, bool trace)
 		{
 			if(!msg || msg->empty())
 				return;
-			boost::unique_lock<boost::mutex> lock(sync_);
-			bool write_in_progress = !write_msgs_.empty();
-			write_msgs_.push_back(msg);
-			if (!write_in_progress)
 			{
-				WriteNextMessage();
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(closed_)
+					return;
+				if(!ReserveQueue(msg->length()))
+					return;
+				if(dropped_msgs_ > 0 && bridge_.GetSendQueuePolicy() == SendQueueDropNewest)
+					PushDroppedNotice();
+				PushQueue(msg);
+				if(trace)
+					TraceEnqueued(msg);
+				if(write_in_progress_)
+					return;
+				write_in_progress_ = true;
 			}
+			// producers may run on any thread, the socket is only touched
+			// from within the session strand
+			strand_.dispatch(boost::bind(&Session::StartWrite, shared_from_this()));
 		}
 
-	private:
+		// replies and keepalives go to the control lane, which is written
+		// ahead of channel lines so they never wait behind a busy channel
+		void DeliverControl(const std::string & text)
+		{
+			if(text.empty())
+				return;
+			ChatMessage msg(Message::Create(text));
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(closed_)
+					return;
+				if(!control_msgs_.empty() && control_bytes_ + msg->length() > bridge_.GetControlQueueBytes())
+				{
+					// the client does not read its replies, no notice would help
+					++dropped_total_;
+					bridge_.GetMetrics().dropped_messages.Add();
+					return;
+				}
+				PushControl(msg);
+				if(write_in_progress_)
+					return;
+				write_in_progress_ = true;
+			}
+			strand_.dispatch(boost::bind(&Session::StartWrite, shared_from_this()));
+		}
+
+		void HandleStart()
+		{
+			initialized_ = true;
+			bridge_.GetMetrics().sessions_accepted.Add();
+			bridge_.GetMetrics().sessions_active.Add(1);
+			timers_.Schedule(register_timeout_, boost::posix_time::seconds(5),
+					strand_.wrap(boost::bind(&Session::HandleRegisterTimeout, shared_from_this())));
+			bridge_.Join(shared_from_this());
+			StartRead();
+		}
+
+		// makes room for a message of the given size according to the chat
+		// send queue policy, returns false if the message must not be queued.
+		// called with sync_ held
+		bool ReserveQueue(size_t length)
+		{
+			const size_t max_bytes = bridge_.GetSendQueueBytes();
+			const size_t max_messages = bridge_.GetSendQueueMessages();
+			if(queued_bytes_ + length <= max_bytes && write_msgs_.size() < max_messages)
+				return true;
+			switch(bridge_.GetSendQueuePolicy())
+			{
+			case SendQueueDropOldest:
+				while(!write_msgs_.empty() &&
+						(queued_bytes_ + length > max_bytes || write_msgs_.size() >= max_messages))
+				{
+					PopQueue();
+					CountDropped();
+				}
+				if(queued_bytes_ + length <= max_bytes && write_msgs_.size() < max_messages)
+					return true;
+				CountDropped();
+				return false;
+			case SendQueueDropNewest:
+				CountDropped();
+				return false;
+			case SendQueueDisconnect:
+				CountDropped();
+				closed_ = true;
+				ClearQueue();
+				strand_.post(boost::bind(&Session::Cleanup, shared_from_this()));
+				return false;
+			}
+			return false;
+		}
+
+		// tells the client how many lines were lost, the notice itself is
+		// small and bypasses the budget. called with sync_ held
+		void PushDroppedNotice()
+		{
+			std::stringstream strstr;
+			strstr<<":"<<bridge_.GetServerName()<<" NOTICE "<<nick_<<" :"
+				<<dropped_msgs_<<" lines dropped, send queue is full\n";
+			dropped_msgs_ = 0;
+			PushQueue(Message::Create(strstr.str()));
+		}
+
+		// queue bookkeeping, all called with sync_ held
+		void PushQueue(const ChatMessage & msg)
+		{
+			write_msgs_.push_back(msg);
+			queued_bytes_ += msg->length();
+			bridge_.GetMetrics().queued_messages.Add(1);
+			bridge_.GetMetrics().queued_bytes.Add(msg->length());
+		}
+
+		void PushControl(const ChatMessage & msg)
+		{
+			control_msgs_.push_back(msg);
+			control_bytes_ += msg->length();
+			bridge_.GetMetrics().queued_messages.Add(1);
+			bridge_.GetMetrics().queued_bytes.Add(msg->length());
+		}
+
+		void PopControl()
+		{
+			const size_t length = control_msgs_.front()->length();
+			control_msgs_.pop_front();
+			control_bytes_ -= length;
+			bridge_.GetMetrics().queued_messages.Sub(1);
+			bridge_.GetMetrics().queued_bytes.Sub(length);
+		}
+
+		void PopQueue()
+		{
+			const size_t length = write_msgs_.front()->length();
+			if(!traced_msgs_.empty() && traced_msgs_.front().first == write_msgs_.front().get())
+				traced_msgs_.pop_front();
+			write_msgs_.pop_front();
+			queued_bytes_ -= length;
+			bridge_.GetMetrics().queued_messages.Sub(1);
+			bridge_.GetMetrics().queued_bytes.Sub(length);
+		}
+
+		void ClearQueue()
+		{
+			bridge_.GetMetrics().queued_messages.Sub(write_msgs_.size() + control_msgs_.size());
+			bridge_.GetMetrics().queued_bytes.Sub(queued_bytes_ + control_bytes_);
+			write_msgs_.clear();
+			control_msgs_.clear();
+			traced_msgs_.clear();
+			queued_bytes_ = 0;
+			control_bytes_ = 0;
+		}
+
+		void CountDropped()
+		{
+			++dropped_msgs_;
+			++dropped_total_;
+			bridge_.GetMetrics().dropped_messages.Add();
+		}
+
+		// latency bookkeeping of sampled lines, called with sync_ held
+		LatencyStats & GetLatency()
+		{
+			if(!latency_)
+				latency_.reset(new LatencyStats());
+			return *latency_;
+		}
+
+		void TraceEnqueued(const ChatMessage & msg)
+		{
+			const boost::uint64_t now = TraceNow();
+			GetLatency().Record(TraceEnqueue, now - msg->GetDispatched());
+			traced_msgs_.push_back(TracedMessage(msg.get(), now));
+		}
+
+		// the front of write_msgs_ is about to be written
+		void TraceWriteStart(boost::uint64_t now)
+		{
+			if(traced_msgs_.empty() || traced_msgs_.front().first != write_msgs_.front().get())
+				return;
+			GetLatency().Record(TraceQueued, now - traced_msgs_.front().second);
+			writing_traced_ = true;
+		}
+
+		void TraceWriteDone()
+		{
+			const boost::uint64_t now = TraceNow();
+			LatencyStats & latency = GetLatency();
+			for(std::vector<ChatMessage>::const_iterator it = writing_msgs_.begin(); it != writing_msgs_.end(); ++it)
+			{
+				if(!(*it)->IsTraced())
+					continue;
+				latency.Record(TraceWrite, now - write_started_);
+				latency.Record(TraceTotal, now - (*it)->GetProduced());
+			}
+			writing_traced_ = false;
+		}
 
 		std::ostream & WriteServerHeader(std::ostream & ostr, const std::string & command_id)
 		{
@@ -117,10 +365,8 @@ namespace debugirc
 			{
 				//std::cerr<<"AUTH "<<nick_<<" success\n";
 				authorized_ = true;
-				register_timeout_.cancel();
-				connection_timeout_.expires_from_now(boost::posix_time::seconds(PingInterval));
-				connection_timeout_.async_wait(boost::bind(&Session::HandleConnectionTimeout, shared_from_this(),
-								boost::asio::placeholders::error));
+				timers_.Cancel(register_timeout_);
+				StartConnectionTimeout(PingInterval);
 				std::stringstream strstr;
 				WriteServerHeader(strstr, "001")<<":Hi "<<nick_<<"\n";
 				WriteServerHeader(strstr, "002")<<":Your host is "<<bridge_.GetServerName()<<", running version 0.0.0\n";
@@ -135,9 +381,12 @@ namespace debugirc
 					{
 						active_channels_.insert(auto_join);
 						WriteUserHeaderNoNick(strstr, "JOIN")<<auto_join<<" :"<<auto_join<<"\n";
+						DeliverControl(strstr.str());
+						ReplayBacklog(auto_join);
+						return;
 					}
 				}
-				Deliver(strstr.str());
+				DeliverControl(strstr.str());
 			}
 			else
 			{
@@ -146,61 +395,65 @@ namespace debugirc
 			}
 		}
 
-		void MessageIgnore(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageIgnore(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{}
 
-		void MessageUnknown(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageUnknown(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			std::stringstream strstr;
 			WriteServerHeader(strstr, "421")<<command_id<<" :Command "<<command_id<<" is unknown or unsupported"<<"\n";
 			answer = strstr.str();
 		}
 
-		void MessageNick(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageNick(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
-			nick_ = data;
+			boost::unique_lock<boost::mutex> lock(sync_);
+			nick_ = data.to_string();
 		}
 
-		void MessagePass(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessagePass(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
-			password_ = data;
+			password_ = data.to_string();
 		}
 
-		void MessageUser(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageUser(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			Authorize();
 		}
 
-		void MessageQuit(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageQuit(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			//std::cerr<<"!!!: quit\n";
 			Cleanup();
 		}
 
-		void MessagePing(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessagePing(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			std::stringstream strstr;
 			WriteServerHeaderNoNick(strstr, "PONG")<<bridge_.GetServerName()<<" :"<<data<<"\n";
 			answer = strstr.str();
 			if(!ping_sent_)
 			{
-				connection_timeout_.expires_from_now(boost::posix_time::seconds(PingInterval));
-				connection_timeout_.async_wait(boost::bind(&Session::HandleConnectionTimeout, shared_from_this(),
-							boost::asio::placeholders::error));
+				StartConnectionTimeout(PingInterval);
 			}
 		}
 
-		void MessageJoin(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageJoin(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			std::stringstream strstr;
-			if(data.length() > 1 && data[0]=='#' && bridge_.JoinChannel(data, shared_from_this()))
+			const std::string channel(data.begin(), data.end());
+			if(channel.length() > 1 && channel[0]=='#' && bridge_.JoinChannel(channel, shared_from_this()))
 			{
 				WriteUserHeaderNoNick(strstr, "JOIN")<<data<<" :"<<data<<"\n";
-				active_channels_.insert(data);
+				active_channels_.insert(channel);
+				// the acknowledgement has to go out before the replayed lines
+				DeliverControl(strstr.str());
+				ReplayBacklog(channel);
+				return;
 			}
 			else
 			{
-				if(active_channels_.find(data) != active_channels_.end())
+				if(active_channels_.find(channel) != active_channels_.end())
 				{
 					WriteUserHeaderNoNick(strstr, "JOIN")<<data<<" :"<<data<<"\n";
 				}
@@ -212,11 +465,19 @@ namespace debugirc
 			answer = strstr.str();
 		}
 
-		void MessagePart(const std::string & command_id, const std::string & data, std::string & answer)
+		void ReplayBacklog(const std::string & channel)
+		{
+			std::vector<ChatMessage> backlog;
+			bridge_.GetChannelBacklog(channel, backlog);
+			for(std::vector<ChatMessage>::const_iterator it = backlog.begin(); it != backlog.end(); ++it)
+				Enqueue(*it, false);
+		}
+
+		void MessagePart(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			std::stringstream strstr;
-			std::string channel;
-			std::string message;
+			boost::string_ref channel;
+			boost::string_ref message;
 			SplitChannelMessage(data, channel, message);
 			if(!channel.empty())
 			{
@@ -224,8 +485,10 @@ namespace debugirc
 				if(!message.empty())
 					strstr<<" :"<<data;
 				strstr<<"\n";
-				bridge_.LeaveChannel(channel, shared_from_this());
-				active_channels_.erase(channel);
+				const std::string channel_name(channel.begin(), channel.end());
+				bridge_.LeaveChannel(channel_name, shared_from_this());
+				active_channels_.erase(channel_name);
+				filters_.erase(channel_name);
 			}
 			else
 			{
@@ -234,7 +497,199 @@ namespace debugirc
 			answer = strstr.str();
 		}
 
-		void MessageList(const std::string & command_id, const std::string & data, std::string & answer)
+		// FILTER <#channel> [SUBSTR|PREFIX|LEVEL|REGEX <pattern> | CLEAR]
+		// adds a rule to the channel subscription, a line is delivered if any
+		// rule matches. without arguments the current rules are listed
+		void MessageFilter(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
+		{
+			std::stringstream strstr;
+			size_t pos = data.find(' ');
+			const std::string channel(data.substr(0, pos).to_string());
+			boost::string_ref kind;
+			boost::string_ref pattern;
+			if(pos != boost::string_ref::npos)
+			{
+				kind = data.substr(pos + 1);
+				pos = kind.find(' ');
+				if(pos != boost::string_ref::npos)
+				{
+					pattern = kind.substr(pos + 1);
+					kind = kind.substr(0, pos);
+					if(!pattern.empty() && pattern[0] == ':')
+						pattern.remove_prefix(1);
+				}
+			}
+			if(active_channels_.find(channel) == active_channels_.end())
+			{
+				WriteServerHeader(strstr, "442")<<channel<<" :You're not on that channel\n";
+				answer = strstr.str();
+				return;
+			}
+			FilterSetPtr & current = filters_[channel];
+			if(kind.empty())
+			{
+				if(current)
+				{
+					const FilterSet::Rules & rules = current->GetRules();
+					for(FilterSet::Rules::const_iterator it = rules.begin(); it != rules.end(); ++it)
+						WriteNotice(strstr)<<"FILTER "<<channel<<" "<<GetFilterKindName(it->GetKind())<<" "<<it->GetPattern()<<"\n";
+				}
+				WriteNotice(strstr)<<"FILTER "<<channel<<" "<<(current ? current->GetRules().size() : 0)<<" rules\n";
+				answer = strstr.str();
+				return;
+			}
+			FilterSetPtr filter;
+			if(kind != "CLEAR")
+			{
+				FilterKind filter_kind;
+				if(!ParseFilterKind(kind, filter_kind) || pattern.empty())
+				{
+					WriteNotice(strstr)<<"FILTER "<<channel<<" :usage FILTER <#channel> [SUBSTR|PREFIX|LEVEL|REGEX <pattern> | CLEAR]\n";
+					answer = strstr.str();
+					return;
+				}
+				FilterSet::Rules rules;
+				if(current)
+					rules = current->GetRules();
+				try
+				{
+					rules.push_back(FilterRule(filter_kind, pattern.to_string()));
+				}
+				catch(const boost::regex_error & e)
+				{
+					WriteNotice(strstr)<<"FILTER "<<channel<<" :invalid regex "<<e.what()<<"\n";
+					answer = strstr.str();
+					return;
+				}
+				filter.reset(new FilterSet(rules));
+			}
+			if(bridge_.SetChannelFilter(channel, shared_from_this(), filter))
+			{
+				current = filter;
+				WriteNotice(strstr)<<"FILTER "<<channel<<" "<<(filter ? filter->GetRules().size() : 0)<<" rules\n";
+			}
+			else
+			{
+				WriteServerHeader(strstr, "403")<<channel<<" :No such channel\n";
+			}
+			if(!current)
+				filters_.erase(channel);
+			answer = strstr.str();
+		}
+
+		// REPLAY <#channel> [<sequence> | @<unix time>]
+		// streams the channel journal from the given line on, or from the
+		// oldest line kept, up to the line that was current when the command
+		// arrived. lines are read as the send queue drains
+		void MessageReplay(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
+		{
+			std::stringstream strstr;
+			const size_t pos = data.find(' ');
+			const std::string channel(data.substr(0, pos).to_string());
+			const std::string from(pos != boost::string_ref::npos ? data.substr(pos + 1).to_string() : std::string());
+			ChannelPtr target = bridge_.GetChannel(channel);
+			if(!target)
+			{
+				WriteServerHeader(strstr, "403")<<channel<<" :No such channel\n";
+				answer = strstr.str();
+				return;
+			}
+			if(!target->GetJournal())
+			{
+				WriteNotice(strstr)<<"REPLAY "<<channel<<" :no journal\n";
+				answer = strstr.str();
+				return;
+			}
+			boost::uint64_t from_sequence = 0;
+			boost::int64_t from_time = 0;
+			if(!from.empty())
+			{
+				const bool time = from[0] == '@';
+				char * end = 0;
+				const unsigned long long value = std::strtoull(from.c_str() + (time ? 1 : 0), &end, 10);
+				if(*end || end == from.c_str() + (time ? 1 : 0))
+				{
+					WriteNotice(strstr)<<"REPLAY "<<channel<<" :usage REPLAY <#channel> [<sequence> | @<unix time>]\n";
+					answer = strstr.str();
+					return;
+				}
+				if(time)
+					from_time = static_cast<boost::int64_t>(value) * 1000000;
+				else
+					from_sequence = value;
+			}
+			replay_ = target->GetJournal()->GetCursor(from_sequence, from_time);
+			replay_channel_ = channel;
+			replay_prefix_ = target->GetPrefix();
+			std::map<std::string, FilterSetPtr>::const_iterator filter = filters_.find(channel);
+			replay_filter_ = filter != filters_.end() ? filter->second : FilterSetPtr();
+			WriteNotice(strstr)<<"REPLAY "<<channel<<" :until sequence "<<replay_->GetStopSequence()<<"\n";
+			DeliverControl(strstr.str());
+			ContinueReplay();
+		}
+
+		// tops up the send queue with the next journal lines of a REPLAY,
+		// called again whenever a write completed
+		void ContinueReplay()
+		{
+			while(replay_)
+			{
+				{
+					boost::unique_lock<boost::mutex> lock(sync_);
+					if(closed_ || queued_bytes_ >= ReplayChunkBytes)
+						return;
+				}
+				std::string text;
+				const bool more = replay_->Read(text, ReplayChunkBytes);
+				if(!text.empty())
+				{
+					ChatMessage msg(Message::Create(text));
+					if(replay_filter_)
+						msg = replay_filter_->Apply(msg, replay_prefix_);
+					if(msg)
+						Enqueue(msg, false);
+				}
+				if(!more)
+				{
+					std::stringstream strstr;
+					WriteNotice(strstr)<<"REPLAY "<<replay_channel_<<" :end, next sequence "<<replay_->GetStopSequence()<<"\n";
+					replay_.reset();
+					replay_filter_.reset();
+					// on the channel lane, it has to follow the replayed lines
+					Deliver(strstr.str());
+				}
+			}
+		}
+
+		std::ostream & WriteNotice(std::ostream & ostr)
+		{
+			ostr<<":"<<bridge_.GetServerName()<<" NOTICE "<<nick_<<" :";
+			return ostr;
+		}
+
+		static bool ParseFilterKind(const boost::string_ref & name, FilterKind & kind)
+		{
+			if(name == "SUBSTR") kind = FilterSubstring;
+			else if(name == "PREFIX") kind = FilterPrefix;
+			else if(name == "LEVEL") kind = FilterLevel;
+			else if(name == "REGEX") kind = FilterRegex;
+			else return false;
+			return true;
+		}
+
+		static const char * GetFilterKindName(FilterKind kind)
+		{
+			switch(kind)
+			{
+			case FilterSubstring: return "SUBSTR";
+			case FilterPrefix: return "PREFIX";
+			case FilterLevel: return "LEVEL";
+			case FilterRegex: return "REGEX";
+			}
+			return "";
+		}
+
+		void MessageList(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			std::stringstream strstr;
 			WriteServerHeader(strstr, "321")<<"Channel :Users  Name\n";
@@ -244,107 +699,163 @@ namespace debugirc
 			answer = strstr.str();
 		}
 
-		void MessageWho(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageStats(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
+			std::stringstream metrics;
+			bridge_.WriteMetrics(metrics);
 			std::stringstream strstr;
-			WriteServerHeader(strstr, "315")<<data<<" :End of /WHO list.\n";
+			std::string line;
+			while(std::getline(metrics, line))
+				WriteServerHeader(strstr, "249")<<":"<<line<<"\n";
+			WriteServerHeader(strstr, "219")<<(data.empty() ? boost::string_ref("*") : data)<<" :End of /STATS report\n";
 			answer = strstr.str();
 		}
 
-		void MessagePong(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessageWho(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			std::stringstream strstr;
+			WriteServerHeader(strstr, "315")<<data<<" :End of /WHO list.\n";
+			answer = strstr.str();
+		}
+
+		void MessagePong(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
+		{
 			if(ping_sent_)
 			{
 				ping_sent_ = false;
-				connection_timeout_.expires_from_now(boost::posix_time::seconds(PingInterval));
-				connection_timeout_.async_wait(boost::bind(&Session::HandleConnectionTimeout, shared_from_this(),
-							boost::asio::placeholders::error));
+				StartConnectionTimeout(PingInterval);
 			}
-			answer = strstr.str();
 		}
 
-		void MessagePrivMsg(const std::string & command_id, const std::string & data, std::string & answer)
+		void MessagePrivMsg(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer)
 		{
 			if(data.empty())
 				return;
 			MessageHandlerPtr handler = bridge_.GetMessageHandler();
 			if(handler)
 			{
-				std::string channel;
-				std::string message;
+				boost::string_ref channel;
+				boost::string_ref message;
 				SplitChannelMessage(data, channel, message);
 				if(!channel.empty() && !message.empty())
 				{
-					handler->Handle(nick_, channel, message, boost::bind(&Session::SendPrivate, this, channel, _1));
+					// MessageHandler takes owning strings, copy only at this boundary
+					const std::string channel_name(channel.begin(), channel.end());
+					HandlerPool * pool = bridge_.GetHandlerPool();
+					if(!pool)
+					{
+						handler->Handle(nick_, channel_name, message.to_string(),
+								boost::bind(&Session::SendPrivate, shared_from_this(), channel_name, _1));
+						return;
+					}
+					if(!pool->Acquire())
+					{
+						std::stringstream strstr;
+						WriteServerHeader(strstr, "263")<<"PRIVMSG :Server load is temporarily too heavy. Please wait a while and try again.\n";
+						answer = strstr.str();
+						return;
+					}
+					// the strand keeps this session's commands in order, it
+					// survives Reset since the pool never changes
+					if(!handler_strand_)
+						handler_strand_.reset(new boost::asio::io_service::strand(pool->GetIoService()));
+					handler_strand_->post(boost::bind(&Session::RunHandler, shared_from_this(), pool, handler,
+								nick_, channel_name, message.to_string()));
 				}
 			}
 		}
 
+		// on a HandlerPool thread. replies go through Deliver, which may be
+		// called from any thread and drops them once the session is closed
+		void RunHandler(HandlerPool * pool, const MessageHandlerPtr & handler, const std::string & nick,
+				const std::string & channel_name, const std::string & message)
+		{
+			try
+			{
+				handler->Handle(nick, channel_name, message,
+						boost::bind(&Session::SendPrivate, shared_from_this(), channel_name, _1));
+			}
+			catch(const std::exception &)
+			{
+				// a failing handler must not take the worker thread down
+			}
+			pool->Release();
+		}
+
 		void SendPrivate(const std::string & channel_id, const std::string & text)
 		{
 			if(channel_id.empty() || text.empty())
 				return;
 			std::stringstream strstr;
 			WriteServerHeaderNoNick(strstr, "PRIVMSG")<<channel_id<<" :"<<text<<"\n";
-			Deliver(strstr.str());
+			DeliverControl(strstr.str());
 		}
 
-		void HandleCommand(const std::string & command_data)
+		void HandleCommand(const boost::string_ref & command_data)
 		{
 			if(command_data.empty())
 				return;
 			size_t pos = command_data.find(' ');
-			std::string command = command_data.substr(0, pos);
-			std::string data = pos == std::string::npos ? "" : command_data.substr(pos + 1);
-			if(!authorized_)
-			{
-				//std::cout<<command<<" "<<data<<"\n";
-				std::map<std::string, MessageHandler>::iterator it = registration_handlers_.find(command);
-				std::string answer;
-				if(it != registration_handlers_.end())
-				{
-					(this->*it->second)(command, data, answer);
-				}
-				else
-				{
-					MessageUnknown(command, data, answer);
-				}
-				Deliver(answer);
+			boost::string_ref command = command_data.substr(0, pos);
+			boost::string_ref data = pos == boost::string_ref::npos ? boost::string_ref() : command_data.substr(pos + 1);
+			//std::cout<<":"<<nick_<<"!"<<nick_<<" "<<command<<" "<<data<<"\n";
+			MessageHandler handler = authorized_ ? FindMessageHandler(command) : FindRegistrationHandler(command);
+			std::string answer;
+			if(handler)
+			{
+				(this->*handler)(command, data, answer);
 			}
 			else
 			{
-				//std::cout<<":"<<nick_<<"!"<<nick_<<" "<<command<<" "<<data<<"\n";
-				std::map<std::string, MessageHandler>::iterator it = message_handlers_.find(command);
-				std::string answer;
-				if(it != message_handlers_.end())
-				{
-					(this->*it->second)(command, data, answer);
-				}
-				else
-				{
-					MessageUnknown(command, data, answer);
-				}
-				Deliver(answer);
+				MessageUnknown(command, data, answer);
 			}
+			DeliverControl(answer);
 		}
 
-		void HandleRead(const boost::system::error_code& error)
+		void StartRead()
+		{
+			socket_.async_read_some(
+				boost::asio::buffer(read_buffer_.data() + read_length_, read_buffer_.size() - read_length_),
+				strand_.wrap(boost::bind(&Session::HandleRead, shared_from_this(),
+								boost::asio::placeholders::error,
+								boost::asio::placeholders::bytes_transferred)));
+		}
+
+		// frames every complete line in the receive buffer and hands out
+		// views into it, the unfinished tail is moved to the front
+		void HandleRead(const boost::system::error_code& error, size_t bytes_transferred)
 		{
 			if (!error)
 			{
-				std::istream is(&buffer_);
-				std::string line;
-				std::getline(is, line);
-				if(line.length() > 0 && line[line.length()-1] == '\r')
-					line.resize(line.length()-1);
-				HandleCommand(line);
-				if(socket_.is_open())
+				char * begin = read_buffer_.data();
+				char * end = begin + read_length_ + bytes_transferred;
+				char * line = begin;
+				while(char * eol = static_cast<char *>(std::memchr(line, '\n', end - line)))
+				{
+					size_t length = eol - line;
+					if(length > 0 && line[length-1] == '\r')
+						--length;
+					if(discard_line_)
+						discard_line_ = false;
+					else
+						HandleCommand(boost::string_ref(line, length));
+					line = eol + 1;
+					if(!socket_.is_open())
+						return;
+				}
+				read_length_ = end - line;
+				if(read_length_ == read_buffer_.size())
+				{
+					// no line fits into the buffer, drop it up to the next newline
+					discard_line_ = true;
+					read_length_ = 0;
+				}
+				else if(line != begin && read_length_)
 				{
-					boost::asio::async_read_until(socket_, buffer_, '\n',
-						boost::bind(&Session::HandleRead, this,
-									boost::asio::placeholders::error));
+					std::memmove(begin, line, read_length_);
 				}
+				if(socket_.is_open())
+					StartRead();
 			}
 			else
 			{
@@ -353,13 +864,40 @@ namespace debugirc
 			}
 		}
 
-		void HandleWrite(const boost::system::error_code& error)
+		void StartWrite()
 		{
-			if (!error)
+			bool close = false;
 			{
 				boost::unique_lock<boost::mutex> lock(sync_);
-				write_msgs_.pop_front();
-				WriteNextMessage();
+				close = WriteNextMessage();
+			}
+			if(close)
+				Cleanup();
+		}
+
+		void HandleWrite(const boost::system::error_code& error, size_t bytes_transferred)
+		{
+			if (!error)
+			{
+				bool close = false;
+				{
+					boost::unique_lock<boost::mutex> lock(sync_);
+					sent_messages_ += writing_msgs_.size();
+					sent_bytes_ += bytes_transferred;
+					bridge_.GetMetrics().sent_messages.Add(writing_msgs_.size());
+					bridge_.GetMetrics().sent_bytes.Add(bytes_transferred);
+					if(writing_traced_)
+						TraceWriteDone();
+					writing_msgs_.clear();
+					close = WriteNextMessage();
+				}
+				if(replay_ && !close)
+					ContinueReplay();
+				if(close)
+				{
+					//std::cerr<<"!!!: closing connection\n";
+					Cleanup();
+				}
 			}
 			else
 			{
@@ -368,59 +906,91 @@ namespace debugirc
 			}
 		}
 
-		void HandleRegisterTimeout(const boost::system::error_code& error)
+		// re-armed on every PING and PONG, the shared wheel keeps that cheap
+		void StartConnectionTimeout(int seconds)
 		{
-			if (!error)
+			timers_.Schedule(connection_timeout_, boost::posix_time::seconds(seconds),
+					strand_.wrap(boost::bind(&Session::HandleConnectionTimeout, shared_from_this())));
+		}
+
+		// the wheel may run a timeout that was cancelled a moment before,
+		// hence the state checks
+		void HandleRegisterTimeout()
+		{
+			if (initialized_ && !authorized_)
 			{
 				closing_connection_ = true;
-				Deliver("ERROR: registration timeout\n");
+				DeliverControl("ERROR: registration timeout\n");
 			}
 		}
 
-		void HandleConnectionTimeout(const boost::system::error_code& error)
+		void HandleConnectionTimeout()
 		{
-			if (!error)
+			if (initialized_)
 			{
 				if(ping_sent_)
 				{
 					closing_connection_ = true;
-					Deliver("ERROR: connection timeout\n");
+					DeliverControl("ERROR: connection timeout\n");
 				}
 				else
 				{
 					ping_sent_ = true;
-					connection_timeout_.expires_from_now(boost::posix_time::seconds(30));
-					connection_timeout_.async_wait(boost::bind(&Session::HandleConnectionTimeout, shared_from_this(),
-								boost::asio::placeholders::error));
+					StartConnectionTimeout(30);
 					std::stringstream strstr;
 					strstr<<"PING :"<<bridge_.GetServerName()<<"\n";
-					Deliver(strstr.str());
+					DeliverControl(strstr.str());
 				}
 			}
 		}
 
-		void WriteNextMessage()
+		// called with sync_ held, returns true if the queue is drained and
+		// the connection should be closed
+		bool WriteNextMessage()
 		{
-			if (!write_msgs_.empty())
+			if(write_msgs_.empty() && dropped_msgs_ > 0 && !closed_ &&
+					bridge_.GetSendQueuePolicy() == SendQueueDropNewest)
+				PushDroppedNotice();
+			if (!write_msgs_.empty() || !control_msgs_.empty())
 			{
-				//std::cout<<(*write_msgs_.front());
-				boost::asio::async_write(socket_,
-						boost::asio::buffer(write_msgs_.front()->c_str(),
-							write_msgs_.front()->length()),
-						boost::bind(&Session::HandleWrite, shared_from_this(),
-							boost::asio::placeholders::error));
-			}
-			else
-			{
-				if(closing_connection_)
+				// drain as much of the queues as fits into one gather write,
+				// control messages first, always taking at least one message
+				// even if it exceeds the limit
+				const size_t limit = bridge_.GetWriteBatchLimit();
+				size_t batch_bytes = 0;
+				write_buffers_.clear();
+				write_started_ = traced_msgs_.empty() ? 0 : TraceNow();
+				while(!control_msgs_.empty() &&
+						(batch_bytes == 0 || batch_bytes + control_msgs_.front()->length() <= limit))
 				{
-					//std::cerr<<"!!!: closing connection\n";
-					Cleanup();
+					const ChatMessage & msg = control_msgs_.front();
+					batch_bytes += msg->length();
+					write_buffers_.push_back(boost::asio::buffer(msg->c_str(), msg->length()));
+					writing_msgs_.push_back(msg);
+					PopControl();
 				}
+				while(!write_msgs_.empty() &&
+						(batch_bytes == 0 || batch_bytes + write_msgs_.front()->length() <= limit))
+				{
+					if(write_started_)
+						TraceWriteStart(write_started_);
+					const ChatMessage & msg = write_msgs_.front();
+					batch_bytes += msg->length();
+					write_buffers_.push_back(boost::asio::buffer(msg->c_str(), msg->length()));
+					writing_msgs_.push_back(msg);
+					PopQueue();
+				}
+				boost::asio::async_write(socket_, write_buffers_,
+						strand_.wrap(boost::bind(&Session::HandleWrite, shared_from_this(),
+							boost::asio::placeholders::error,
+							boost::asio::placeholders::bytes_transferred)));
+				return false;
 			}
+			write_in_progress_ = false;
+			return closing_connection_;
 		}
 
-		void SplitChannelMessage(const std::string & data, std::string & channel, std::string & message)
+		void SplitChannelMessage(const boost::string_ref & data, boost::string_ref & channel, boost::string_ref & message)
 		{
 			if(data.empty())
 				return;
@@ -428,12 +998,13 @@ namespace debugirc
 			if(data[0] == '#')
 			{
 				channel = data.substr(0, pos);
-				if(pos != std::string::npos)
+				if(pos != boost::string_ref::npos)
 				{
-					pos = data.find(':', pos+1);
-					if(pos != std::string::npos)
+					boost::string_ref rest = data.substr(pos+1);
+					pos = rest.find(':');
+					if(pos != boost::string_ref::npos)
 					{
-						message = data.substr(pos+1);
+						message = rest.substr(pos+1);
 					}
 				}
 			}
@@ -450,6 +1021,16 @@ namespace debugirc
 					active_channels_.clear();
 				}
 				bridge_.Leave(shared_from_this());
+				replay_.reset();
+				{
+					boost::unique_lock<boost::mutex> lock(sync_);
+					closed_ = true;
+					ClearQueue();
+				}
+				bridge_.GetMetrics().sessions_active.Sub(1);
+				// pending waits would keep the session alive for minutes
+				timers_.Cancel(register_timeout_);
+				timers_.Cancel(connection_timeout_);
 				if(socket_.is_open())
 					socket_.close();
 				initialized_ = false;
@@ -478,24 +1059,116 @@ namespace debugirc
 		};
 
 	private:
-		typedef  void (Session::*MessageHandler)(const std::string & command_id, const std::string & data, std::string & answer);
+		typedef  void (Session::*MessageHandler)(const boost::string_ref & command_id, const boost::string_ref & data, std::string & answer);
+
+		template<size_t N>
+		static bool IsCommand(const boost::string_ref & command, const char (&name)[N])
+		{
+			return command.length() == N - 1 && std::memcmp(command.data(), name, N - 1) == 0;
+		}
+
+		// command tables are fixed, so dispatch is a switch on the first
+		// letter followed by a single compare instead of a per session map
+		static MessageHandler FindRegistrationHandler(const boost::string_ref & command)
+		{
+			if(command.empty())
+				return 0;
+			switch(command[0])
+			{
+			case 'N':
+				return IsCommand(command, "NICK") ? &Session::MessageNick : 0;
+			case 'P':
+				return IsCommand(command, "PASS") ? &Session::MessagePass : 0;
+			case 'U':
+				return IsCommand(command, "USER") ? &Session::MessageUser : 0;
+			}
+			return 0;
+		}
+
+		static MessageHandler FindMessageHandler(const boost::string_ref & command)
+		{
+			if(command.empty())
+				return 0;
+			switch(command[0])
+			{
+			case 'F':
+				return IsCommand(command, "FILTER") ? &Session::MessageFilter : 0;
+			case 'J':
+				return IsCommand(command, "JOIN") ? &Session::MessageJoin : 0;
+			case 'L':
+				return IsCommand(command, "LIST") ? &Session::MessageList : 0;
+			case 'M':
+				return IsCommand(command, "MODE") ? &Session::MessageIgnore : 0;
+			case 'N':
+				return IsCommand(command, "NOTICE") ? &Session::MessageIgnore : 0;
+			case 'P':
+				if(IsCommand(command, "PRIVMSG"))
+					return &Session::MessagePrivMsg;
+				if(IsCommand(command, "PING"))
+					return &Session::MessagePing;
+				if(IsCommand(command, "PONG"))
+					return &Session::MessagePong;
+				if(IsCommand(command, "PART"))
+					return &Session::MessagePart;
+				return 0;
+			case 'Q':
+				return IsCommand(command, "QUIT") ? &Session::MessageQuit : 0;
+			case 'R':
+				return IsCommand(command, "REPLAY") ? &Session::MessageReplay : 0;
+			case 'S':
+				return IsCommand(command, "STATS") ? &Session::MessageStats : 0;
+			case 'W':
+				return IsCommand(command, "WHO") ? &Session::MessageWho : 0;
+			}
+			return 0;
+		}
 
+		boost::asio::io_service & io_service_;
+		boost::asio::io_service::strand strand_;
+		boost::scoped_ptr<boost::asio::io_service::strand> handler_strand_;
 		tcp::socket socket_;
 		Chat& bridge_;
-		boost::asio::streambuf buffer_;
+		boost::array<char, ReceiveBufferSize> read_buffer_;
+		size_t read_length_;
+		bool discard_line_;
 		ChatMessageQueue write_msgs_;
+		ChatMessageQueue control_msgs_;
+		std::vector<ChatMessage> writing_msgs_;
+		std::vector<boost::asio::const_buffer> write_buffers_;
+		bool write_in_progress_;
+		size_t queued_bytes_;
+		size_t control_bytes_;
+		size_t dropped_msgs_;
+		boost::uint64_t dropped_total_;
+		boost::uint64_t sent_messages_;
+		boost::uint64_t sent_bytes_;
+		// send queue entries of sampled lines with the time they were queued,
+		// in queue order
+		typedef std::pair<const Message *, boost::uint64_t> TracedMessage;
+		std::deque<TracedMessage> traced_msgs_;
+		boost::shared_ptr<LatencyStats> latency_;
+		boost::uint64_t write_started_;
+		bool writing_traced_;
+		// no more messages are queued once set, after an overflow disconnect
+		// or cleanup
+		bool closed_;
 		bool initialized_;
 		bool authorized_;
-		boost::asio::deadline_timer register_timeout_;
-		boost::asio::deadline_timer connection_timeout_;
+		TimerWheelEntry register_timeout_;
+		TimerWheelEntry connection_timeout_;
 		std::string nick_;
 		std::string password_;
 		std::set<std::string> active_channels_;
+		std::map<std::string, FilterSetPtr> filters_;
+		// active REPLAY, only touched within the strand
+		JournalCursorPtr replay_;
+		std::string replay_channel_;
+		std::string replay_prefix_;
+		FilterSetPtr replay_filter_;
 		bool closing_connection_;
 		bool ping_sent_;
-		boost::mutex sync_;
-		std::map<std::string, MessageHandler> registration_handlers_;
-		std::map<std::string, MessageHandler> message_handlers_;
+		TimerWheel & timers_;
+		mutable boost::mutex sync_;
 	};
 
 	typedef boost::shared_ptr<Session> SessionPtr;
@@ -0,0 +1,119 @@
+/* sessionpool.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include "chat.hpp"
+#include "session.hpp"
+
+namespace debugirc
+{
+	// sessions of one io_service. the SessionPtr handed out by Acquire
+	// does not delete the session when the last reference goes away, the
+	// session is reset and kept for the next accept, up to max_idle of them
+	class SessionPool
+		: public boost::enable_shared_from_this<SessionPool>,
+			private boost::noncopyable
+	{
+	public:
+		typedef boost::function<void ()> ReleaseHandler;
+
+		SessionPool(boost::asio::io_service & io_service, Chat & chat, size_t max_idle,
+				const ReleaseHandler & on_release = ReleaseHandler())
+			: io_service_(io_service),
+				chat_(chat),
+				max_idle_(max_idle),
+				on_release_(on_release)
+		{
+			idle_.reserve(max_idle_);
+			for(size_t i = 0; i < max_idle_; ++i)
+				idle_.push_back(new Session(io_service_, chat_));
+		}
+
+		~SessionPool()
+		{
+			for(size_t i = 0; i < idle_.size(); ++i)
+				delete idle_[i];
+		}
+
+		boost::asio::io_service & GetIoService() { return io_service_; }
+
+		SessionPtr Acquire()
+		{
+			Session * session = 0;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(!idle_.empty())
+				{
+					session = idle_.back();
+					idle_.pop_back();
+				}
+			}
+			if(!session)
+				session = new Session(io_service_, chat_);
+			return SessionPtr(session, Recycler(shared_from_this()));
+		}
+
+		size_t GetIdleCount() const
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			return idle_.size();
+		}
+
+	private:
+		// outlives the pool in the shared_ptr control block, once the pool
+		// is gone sessions are deleted as usual
+		struct Recycler
+		{
+			explicit Recycler(const boost::shared_ptr<SessionPool> & pool)
+				: pool_(pool)
+			{}
+
+			void operator()(Session * session) const
+			{
+				if(boost::shared_ptr<SessionPool> pool = pool_.lock())
+					pool->Release(session);
+				else
+					delete session;
+			}
+
+			boost::weak_ptr<SessionPool> pool_;
+		};
+
+		void Release(Session * session)
+		{
+			session->Reset();
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(idle_.size() < max_idle_)
+				{
+					idle_.push_back(session);
+					session = 0;
+				}
+			}
+			delete session;
+			if(on_release_)
+				on_release_();
+		}
+
+		boost::asio::io_service & io_service_;
+		Chat & chat_;
+		const size_t max_idle_;
+		ReleaseHandler on_release_;
+		std::vector<Session *> idle_;
+		mutable boost::mutex sync_;
+	};
+
+	typedef boost::shared_ptr<SessionPool> SessionPoolPtr;
+} // namespace debugirc
@@ -0,0 +1,117 @@
+/* subscription.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include "participant.hpp"
+#include "filter.hpp"
+
+namespace debugirc
+{
+	// channel member, lines are matched against filter unless it is empty
+	struct Subscription
+	{
+		explicit Subscription(const ChatParticipantPtr & participant_,
+				const FilterSetPtr & filter_ = FilterSetPtr())
+			: participant(participant_),
+				filter(filter_)
+		{}
+
+		ChatParticipantPtr participant;
+		FilterSetPtr filter;
+	};
+
+	// read-copy-update list of subscriptions, see ParticipantSet. member and
+	// filter live in one snapshot so changing a filter never loses or
+	// duplicates a line
+	class SubscriptionSet
+		: private boost::noncopyable
+	{
+	public:
+		typedef std::vector<Subscription> List;
+		typedef boost::shared_ptr<const List> Snapshot;
+
+		SubscriptionSet()
+			: list_(new List()),
+				size_(0)
+		{}
+
+		Snapshot Get() const
+		{
+			return boost::atomic_load(&list_);
+		}
+
+		bool Insert(const ChatParticipantPtr & participant)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			if(Find(participant) != list_->end())
+				return false;
+			boost::shared_ptr<List> list(new List());
+			list->reserve(list_->size() + 1);
+			list->assign(list_->begin(), list_->end());
+			list->push_back(Subscription(participant));
+			boost::atomic_store(&list_, Snapshot(list));
+			size_.store(list->size(), boost::memory_order_relaxed);
+			return true;
+		}
+
+		void Erase(const ChatParticipantPtr & participant)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			List::const_iterator it = Find(participant);
+			if(it == list_->end())
+				return;
+			boost::shared_ptr<List> list(new List());
+			list->reserve(list_->size() - 1);
+			list->insert(list->end(), list_->begin(), it);
+			list->insert(list->end(), it + 1, list_->end());
+			boost::atomic_store(&list_, Snapshot(list));
+			size_.store(list->size(), boost::memory_order_relaxed);
+		}
+
+		// an empty filter delivers every line, returns false if the
+		// participant is not subscribed
+		bool SetFilter(const ChatParticipantPtr & participant, const FilterSetPtr & filter)
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			List::const_iterator it = Find(participant);
+			if(it == list_->end())
+				return false;
+			boost::shared_ptr<List> list(new List(*list_));
+			(*list)[it - list_->begin()].filter = filter;
+			boost::atomic_store(&list_, Snapshot(list));
+			return true;
+		}
+
+		// a plain atomic load, cheaper than taking a snapshot. it may lag
+		// behind a concurrent Insert or Erase
+		size_t GetSize() const
+		{
+			return size_.load(boost::memory_order_relaxed);
+		}
+
+	private:
+		// called with sync_ held
+		List::const_iterator Find(const ChatParticipantPtr & participant) const
+		{
+			for(List::const_iterator it = list_->begin(); it != list_->end(); ++it)
+				if(it->participant == participant)
+					return it;
+			return list_->end();
+		}
+
+		Snapshot list_;
+		boost::atomic<size_t> size_;
+		boost::mutex sync_;
+	};
+
+	typedef boost::shared_ptr<SubscriptionSet> SubscriptionSetPtr;
+} // namespace debugirc
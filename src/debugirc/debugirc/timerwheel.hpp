@@ -0,0 +1,253 @@
+/* timerwheel.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace debugirc
+{
+	class TimerWheel;
+
+	// one deadline, owned by whoever arms it. the wheel links it into a
+	// slot list, so arming and cancelling never allocate or search
+	class TimerWheelEntry
+		: private boost::noncopyable
+	{
+	public:
+		TimerWheelEntry()
+			: wheel_(0),
+				prev_(0),
+				next_(0),
+				expiry_(0)
+		{}
+
+		inline ~TimerWheelEntry();
+
+		bool IsScheduled() const { return next_ != 0; }
+
+	private:
+		friend class TimerWheel;
+
+		void Unlink()
+		{
+			prev_->next_ = next_;
+			next_->prev_ = prev_;
+			prev_ = next_ = 0;
+		}
+
+		TimerWheel * wheel_;
+		TimerWheelEntry * prev_;
+		TimerWheelEntry * next_;
+		boost::uint64_t expiry_; // in ticks
+		boost::function<void ()> handler_;
+	};
+
+	// hierarchical timing wheel shared by everything on one io_service, see
+	// boost::asio::use_service<TimerWheel>. a single deadline_timer ticks
+	// while anything is scheduled, deadlines are rounded up to whole ticks.
+	// handlers run on an io_service thread with no lock held, wrap them in
+	// a strand where needed. like an asio timer, a handler already picked
+	// up by a tick may still run after Cancel
+	class TimerWheel
+		: public boost::asio::detail::service_base<TimerWheel>
+	{
+	public:
+		typedef boost::function<void ()> Handler;
+
+		static const int LevelBits = 6;
+		static const int Slots = 1 << LevelBits;
+		static const int Levels = 4; // 2^24 ticks, about 19 days
+		static const int TickMilliseconds = 100;
+
+		explicit TimerWheel(boost::asio::io_service & io_service)
+			: boost::asio::detail::service_base<TimerWheel>(io_service),
+				timer_(io_service),
+				current_(0),
+				scheduled_(0),
+				running_(false)
+		{
+			for(int level = 0; level < Levels; ++level)
+				for(int slot = 0; slot < Slots; ++slot)
+					slots_[level][slot].prev_ = slots_[level][slot].next_ = &slots_[level][slot];
+		}
+
+		// replaces a previous deadline of the entry
+		void Schedule(TimerWheelEntry & entry, const boost::posix_time::time_duration & delay, const Handler & handler)
+		{
+			boost::int64_t ticks = (delay.total_milliseconds() + TickMilliseconds - 1) / TickMilliseconds;
+			if(ticks < 1)
+				ticks = 1;
+			Handler previous(handler);
+			boost::unique_lock<boost::mutex> lock(sync_);
+			if(entry.IsScheduled())
+				entry.Unlink();
+			else
+				++scheduled_;
+			entry.wheel_ = this;
+			// the replaced handler is destroyed outside the lock
+			entry.handler_.swap(previous);
+			entry.expiry_ = current_ + ticks;
+			Link(entry);
+			if(!running_)
+			{
+				running_ = true;
+				next_tick_ = boost::posix_time::microsec_clock::universal_time() +
+					boost::posix_time::milliseconds(TickMilliseconds);
+				StartTimer();
+			}
+		}
+
+		void Cancel(TimerWheelEntry & entry)
+		{
+			Handler handler;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(!entry.IsScheduled())
+					return;
+				entry.Unlink();
+				--scheduled_;
+				// destroyed outside the lock, it may own the entry
+				handler.swap(entry.handler_);
+			}
+		}
+
+		size_t GetScheduledCount() const
+		{
+			boost::unique_lock<boost::mutex> lock(sync_);
+			return scheduled_;
+		}
+
+	private:
+		virtual void shutdown()
+		{
+			std::vector<Handler> handlers;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				for(int level = 0; level < Levels; ++level)
+					for(int slot = 0; slot < Slots; ++slot)
+						Collect(slots_[level][slot], handlers);
+				scheduled_ = 0;
+				running_ = false;
+			}
+			boost::system::error_code ignored;
+			timer_.cancel(ignored);
+		}
+
+		// level l holds deadlines less than 2^(6(l+1)) ticks away, slot by
+		// the matching bits of the expiry. called with sync_ held
+		void Link(TimerWheelEntry & entry)
+		{
+			const boost::uint64_t delta = entry.expiry_ > current_ ? entry.expiry_ - current_ : 0;
+			int level = 0;
+			while(level < Levels - 1 && delta >= (boost::uint64_t(1) << (LevelBits * (level + 1))))
+				++level;
+			if(delta >= (boost::uint64_t(1) << (LevelBits * Levels)))
+				entry.expiry_ = current_ + (boost::uint64_t(1) << (LevelBits * Levels)) - 1;
+			TimerWheelEntry & head = slots_[level][(entry.expiry_ >> (LevelBits * level)) & (Slots - 1)];
+			entry.prev_ = head.prev_;
+			entry.next_ = &head;
+			head.prev_->next_ = &entry;
+			head.prev_ = &entry;
+		}
+
+		// unlinks the whole slot and moves the handlers out
+		void Collect(TimerWheelEntry & head, std::vector<Handler> & handlers)
+		{
+			while(head.next_ != &head)
+			{
+				TimerWheelEntry & entry = *head.next_;
+				entry.Unlink();
+				handlers.push_back(Handler());
+				handlers.back().swap(entry.handler_);
+			}
+		}
+
+		// moves one tick forward, entries of a higher level slot are spread
+		// over the lower levels when the lower bits wrap around
+		void Advance(std::vector<Handler> & handlers)
+		{
+			++current_;
+			for(int level = 1; level < Levels; ++level)
+			{
+				if((current_ & ((boost::uint64_t(1) << (LevelBits * level)) - 1)) != 0)
+					break;
+				TimerWheelEntry & head = slots_[level][(current_ >> (LevelBits * level)) & (Slots - 1)];
+				TimerWheelEntry pending;
+				if(head.next_ == &head)
+					continue;
+				// splice out first, Link may put entries back into this slot
+				pending.next_ = head.next_;
+				pending.prev_ = head.prev_;
+				pending.next_->prev_ = &pending;
+				pending.prev_->next_ = &pending;
+				head.prev_ = head.next_ = &head;
+				while(pending.next_ != &pending)
+				{
+					TimerWheelEntry & entry = *pending.next_;
+					entry.Unlink();
+					Link(entry);
+				}
+				pending.prev_ = pending.next_ = 0;
+			}
+			const size_t before = handlers.size();
+			Collect(slots_[0][current_ & (Slots - 1)], handlers);
+			scheduled_ -= handlers.size() - before;
+		}
+
+		void StartTimer()
+		{
+			timer_.expires_at(next_tick_);
+			timer_.async_wait(boost::bind(&TimerWheel::HandleTick, this, boost::asio::placeholders::error));
+		}
+
+		void HandleTick(const boost::system::error_code & error)
+		{
+			if(error)
+				return;
+			std::vector<Handler> handlers;
+			{
+				boost::unique_lock<boost::mutex> lock(sync_);
+				if(!running_)
+					return;
+				// catches up when the io_service was busy for several ticks
+				const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+				while(next_tick_ <= now)
+				{
+					Advance(handlers);
+					next_tick_ += boost::posix_time::milliseconds(TickMilliseconds);
+				}
+				if(scheduled_)
+					StartTimer();
+				else
+					running_ = false;
+			}
+			for(size_t i = 0; i < handlers.size(); ++i)
+				handlers[i]();
+		}
+
+		boost::asio::deadline_timer timer_;
+		TimerWheelEntry slots_[Levels][Slots]; // list heads
+		boost::uint64_t current_;
+		size_t scheduled_;
+		bool running_;
+		boost::posix_time::ptime next_tick_;
+		mutable boost::mutex sync_;
+	};
+
+	inline TimerWheelEntry::~TimerWheelEntry()
+	{
+		// list heads and entries that never were scheduled have no wheel
+		if(wheel_ && IsScheduled())
+			wheel_->Cancel(*this);
+	}
+} // namespace debugirc
@@ -0,0 +1,125 @@
+/* trace.hpp
+ * This file is a part of debugirc library
+ * Copyright (c) debugirc authors (see file `COPYRIGHT` for the license)
+ */
+
+#pragma once
+
+#include <string>
+#include <ostream>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include "histogram.hpp"
+
+namespace debugirc
+{
+	// monotonic nanoseconds, only differences are meaningful
+	inline boost::uint64_t TraceNow()
+	{
+		return boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+				boost::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// stages a sampled line goes through. dispatch and fanout are recorded
+	// per channel, the others per session
+	enum TraceStage
+	{
+		TraceDispatch, // DeliverChannel call until fan out starts (ingest queue, channel lookup)
+		TraceFanout, // delivery to every subscriber of the channel
+		TraceEnqueue, // fan out start until queued by a session (session lock)
+		TraceQueued, // waiting in the send queue
+		TraceWrite, // async_write until completion
+		TraceTotal, // DeliverChannel call until the write completed
+		TraceStageCount
+	};
+
+	inline const char * GetTraceStageName(TraceStage stage)
+	{
+		static const char * const names[TraceStageCount] =
+			{ "dispatch", "fanout", "enqueue", "queued", "write", "total" };
+		return names[stage];
+	}
+
+	// picks one of every n lines, n = 0 turns tracing off
+	class TraceSampler
+		: private boost::noncopyable
+	{
+	public:
+		TraceSampler() : rate_(0), counter_(0) {}
+
+		void SetRate(size_t one_in) { rate_.store(one_in, boost::memory_order_relaxed); }
+		size_t GetRate() const { return rate_.load(boost::memory_order_relaxed); }
+
+		bool Sample()
+		{
+			const size_t rate = rate_.load(boost::memory_order_relaxed);
+			return rate && counter_.fetch_add(1, boost::memory_order_relaxed) % rate == 0;
+		}
+
+	private:
+		boost::atomic<size_t> rate_;
+		boost::atomic<size_t> counter_;
+	};
+
+	// one histogram of nanoseconds per stage. a histogram takes about 15KB,
+	// so it is only allocated once its stage records the first sample
+	class LatencyStats
+		: private boost::noncopyable
+	{
+	public:
+		LatencyStats()
+		{
+			for(int i = 0; i < TraceStageCount; ++i)
+				stages_[i].store(0, boost::memory_order_relaxed);
+		}
+
+		~LatencyStats()
+		{
+			for(int i = 0; i < TraceStageCount; ++i)
+				delete stages_[i].load(boost::memory_order_relaxed);
+		}
+
+		void Record(TraceStage stage, boost::uint64_t nanoseconds)
+		{
+			Histogram * histogram = stages_[stage].load(boost::memory_order_acquire);
+			if(!histogram)
+			{
+				Histogram * created = new Histogram();
+				if(stages_[stage].compare_exchange_strong(histogram, created, boost::memory_order_acq_rel))
+					histogram = created;
+				else
+					delete created;
+			}
+			histogram->Record(nanoseconds);
+		}
+
+		const Histogram * Get(TraceStage stage) const
+		{
+			return stages_[stage].load(boost::memory_order_acquire);
+		}
+
+		// prometheus summary, labels are inserted verbatim before the stage
+		void WriteMetrics(std::ostream & ostr, const std::string & metric, const std::string & labels) const
+		{
+			static const char * const quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+			static const double values[] = { 0.5, 0.9, 0.99, 0.999 };
+			for(int i = 0; i < TraceStageCount; ++i)
+			{
+				const Histogram * histogram = Get(static_cast<TraceStage>(i));
+				if(!histogram)
+					continue;
+				const std::string stage = labels + ",stage=\"" + GetTraceStageName(static_cast<TraceStage>(i)) + "\"";
+				for(size_t q = 0; q < sizeof(values) / sizeof(values[0]); ++q)
+					ostr<<metric<<"{"<<stage<<",quantile=\""<<quantiles[q]<<"\"} "
+						<<histogram->GetPercentile(values[q]) / 1e9<<"\n";
+				ostr<<metric<<"{"<<stage<<",quantile=\"1\"} "<<histogram->GetMax() / 1e9<<"\n"
+					<<metric<<"_count{"<<stage<<"} "<<histogram->GetCount()<<"\n";
+			}
+		}
+
+	private:
+		boost::atomic<Histogram *> stages_[TraceStageCount];
+	};
+} // namespace debugirc
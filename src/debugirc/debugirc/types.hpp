@@ -7,10 +7,17 @@
 
 #include <string>
 #include <deque>
-#include <boost/shared_ptr.hpp>
+#include "message.hpp"
 
 namespace debugirc
 {
-	typedef boost::shared_ptr<std::string> ChatMessage;
 	typedef std::deque<ChatMessage> ChatMessageQueue;
+
+	// what a session does when its send queue is over budget
+	enum SendQueuePolicy
+	{
+		SendQueueDropOldest,
+		SendQueueDropNewest,
+		SendQueueDisconnect
+	};
 } // namespace debugirc
@@ -4,16 +4,24 @@
  */
 
 #include <iostream>
+#include <sstream>
+#include <cstring>
 #include <boost/array.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/barrier.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
 #include <signal.h>
 #include "shutdown_manager.hpp"
 #include "debugirc/debugirc.hpp"
 
+std::string FormatRandom()
+{
+	return boost::lexical_cast<std::string>(rand());
+}
+
 void DebugThread(debugirc::Server &  srv)
 {
 	try
@@ -22,10 +30,15 @@ void DebugThread(debugirc::Server &  srv)
 		{
 			boost::this_thread::interruption_point();
 			boost::this_thread::sleep(boost::posix_time::milliseconds(rand()%500 + 500));
-			if((rand()%1000) < 300)
-				srv.GetChat().DeliverChannel("#system", boost::lexical_cast<std::string>(rand()));
+			const int kind = rand()%1000;
+			if(kind < 300)
+				srv.GetChat().DeliverChannelDeferred("#system", &FormatRandom);
+			else if(kind < 500)
+				srv.GetChat().DeliverChannel(kind < 400 ? "#log.debugircd.even" : "#log.debugircd.odd",
+						boost::lexical_cast<std::string>(kind));
 			else
-				srv.GetChat().DeliverChannel("#debug", boost::lexical_cast<std::string>(rand()));
+				srv.GetChat().DeliverChannel(debugirc::LogRecord("#debug", "DEBUG", "debugircd",
+						boost::lexical_cast<std::string>(rand())));
 		}
 	}
 	catch(boost::thread_interrupted const&)
@@ -43,6 +56,9 @@ public:
 	{
 		if(channel == "#system")
 		{
+			// stands in for a slow command, see --handler-threads
+			if(data == "sleep")
+				boost::this_thread::sleep(boost::posix_time::seconds(2));
 			std::stringstream strstr;
 			strstr<<"system command "<<data;
 			send_callback(strstr.str());
@@ -68,31 +84,112 @@ int main(int argc, char** argv)
 #else
 		signal(SIGINT, handle_signal);
 #endif
-		if (argc != 2)
+		// positional arguments come first, options follow
+		int positional = 1;
+		while(positional < argc && std::strncmp(argv[positional], "--", 2) != 0)
+			++positional;
+		const char * hub_port = 0;
+		const char * leaf_name = 0;
+		const char * leaf_hub = 0;
+		const char * leaf_channels = 0;
+		const char * journal_directory = 0;
+		size_t handler_threads = 0;
+		debugirc::ServerConfig server_config;
+		bool usage = positional < 2 || positional > 4;
+		for(int i = positional; i < argc && !usage; ++i)
+		{
+			if(std::strcmp(argv[i], "--hub") == 0 && i + 1 < argc)
+				hub_port = argv[++i];
+			else if(std::strcmp(argv[i], "--leaf") == 0 && i + 3 < argc)
+			{
+				leaf_name = argv[++i];
+				leaf_hub = argv[++i];
+				leaf_channels = argv[++i];
+			}
+			else if(std::strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc)
+				server_config.max_sessions = std::atoi(argv[++i]);
+			else if(std::strcmp(argv[i], "--reuse-port") == 0)
+				server_config.reuse_port = true;
+			else if(std::strcmp(argv[i], "--journal") == 0 && i + 1 < argc)
+				journal_directory = argv[++i];
+			else if(std::strcmp(argv[i], "--handler-threads") == 0 && i + 1 < argc)
+				handler_threads = std::atoi(argv[++i]);
+			else
+				usage = true;
+		}
+		if (usage)
 		{
-			std::cerr << "Usage: debugircd <port>\n";
+			std::cerr << "Usage: debugircd <port> [io threads] [metrics port]"
+				" [--hub <link port>] [--leaf <name> <hub host:port> <#channel,...>]"
+				" [--max-sessions <n>] [--reuse-port] [--journal <directory>]"
+				" [--handler-threads <n>]\n";
 			return 1;
 		}
 
-		boost::asio::io_service io_service;
+		// declared before the server, it has to outlive the sessions
+		boost::scoped_ptr<debugirc::HandlerPool> handler_pool;
+		if(handler_threads)
+			handler_pool.reset(new debugirc::HandlerPool(handler_threads));
+		debugirc::IoServicePool pool(positional >= 3 ? std::atoi(argv[2]) : 0);
 		boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), std::atoi(argv[1]));
-		debugirc::Server s(io_service, endpoint);
+		debugirc::Server s(pool, endpoint, server_config);
+		if(positional == 4)
+			s.StartMetricsListener(boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), std::atoi(argv[3])));
+		if(hub_port)
+			s.StartLinkListener(boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), std::atoi(hub_port)));
 
 		s.GetChat().AddChannel("#system", "System channel");
 		s.GetChat().SetAutoJoin("#system");
-		s.GetChat().AddChannel("#debug", "DEBUG");
+		debugirc::ChannelConfig debug_config;
+		debug_config.backlog_lines = 100;
+		debug_config.rate_limit = 1000;
+		if(journal_directory)
+		{
+			debug_config.journal_directory = journal_directory;
+			debug_config.journal_segment_bytes = 4 * 1024 * 1024;
+			debug_config.journal_segments = 8;
+		}
+		s.GetChat().AddChannel("#debug", "DEBUG", debug_config);
+		s.GetChat().AddChannelTree("#log", "Log tree", debugirc::ChannelConfig());
 		s.GetChat().AddChannel("#test", "Test  CHANNEL");
 		s.GetChat().AddChannel("#test2", "TEST2");
 		s.GetChat().SetMessageHandler(debugirc::MessageHandlerPtr(new TestMessageHandler(s)));
+		if(handler_pool)
+		{
+			s.GetChat().EnableHandlerPool(*handler_pool);
+			handler_pool->Start();
+		}
+		s.GetChat().EnableAsyncDelivery(pool.GetIoService(0));
+		s.GetChat().SetTraceSampleRate(10);
+		if(leaf_name)
+		{
+			std::string hub(leaf_hub);
+			const size_t colon = hub.rfind(':');
+			if(colon == std::string::npos)
+			{
+				std::cerr << "--leaf expects the hub as host:port\n";
+				return 1;
+			}
+			boost::asio::ip::tcp::endpoint hub_endpoint(
+				boost::asio::ip::address::from_string(hub.substr(0, colon)), std::atoi(hub.c_str() + colon + 1));
+			debugirc::LinkClientPtr link = s.ConnectHub(leaf_name, hub_endpoint);
+			std::stringstream channels(leaf_channels);
+			std::string channel;
+			while(std::getline(channels, channel, ','))
+				if(!link->Forward(channel))
+					std::cerr << "cannot forward " << channel << "\n";
+		}
 
-		boost::thread t(boost::bind(&boost::asio::io_service::run, &io_service));
+		pool.Start();
 		boost::thread_group t2;
 		for(int i = 0; i < 32; ++i)
 			t2.create_thread(boost::bind(&DebugThread, boost::ref(s)));
 		main_shutdown_manager.wait();
 		t2.interrupt_all();
 		t2.join_all();
-		io_service.stop();
+		pool.Stop();
+		if(handler_pool)
+			handler_pool->Stop();
 	}
 	catch(std::exception & e)
 	{